@@ -5,14 +5,23 @@
 #include "devices/serial.h"
 #include "devices/timer.h"
 #include "threads/io.h"
+#include "threads/mprof.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/exception.h"
+#include "userprog/pagedir.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
 #include "filesys/filesys.h"
 #endif
+#ifdef VM
+#include "vm/frame.h"
+#include "vm/swap.h"
+#include "vm/vm_area.h"
+#include "vm/fault.h"
+#endif
 
 /* Keyboard control register port. */
 #define CONTROL_REG 0x64
@@ -131,6 +140,8 @@ print_stats (void)
 {
   timer_print_stats ();
   thread_print_stats ();
+  palloc_print_stats ();
+  mprof_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
 #endif
@@ -138,5 +149,12 @@ print_stats (void)
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
+  pagedir_print_stats ();
+#endif
+#ifdef VM
+  frame_table_print_stats ();
+  swap_print_stats ();
+  vm_area_print_stats ();
+  fault_print_stats ();
 #endif
 }
@@ -41,6 +41,22 @@ file_reopen (struct file *file)
   return file_open (inode_reopen (file->inode));
 }
 
+/* Opens and returns a new file for the same inode as FILE, at the
+   same position, that denies writes to the inode if FILE does.
+   Returns a null pointer if unsuccessful. */
+struct file *
+file_dup (struct file *file) 
+{
+  struct file *copy = file_reopen (file);
+  if (copy != NULL)
+    {
+      copy->pos = file->pos;
+      if (file->deny_write)
+        file_deny_write (copy);
+    }
+  return copy;
+}
+
 /* Closes FILE. */
 void
 file_close (struct file *file) 
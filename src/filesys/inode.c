@@ -222,8 +222,15 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
       if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
+          /* Read all of the full sectors that follow directly into
+             caller's buffer, with as few disk commands as the
+             device allows.  A file's sectors are contiguous. */
+          off_t full = size < inode_left ? size : inode_left;
+          size_t sector_cnt = full / BLOCK_SECTOR_SIZE;
+
+          block_read_multiple (fs_device, sector_idx, sector_cnt,
+                               buffer + bytes_read);
+          chunk_size = sector_cnt * BLOCK_SECTOR_SIZE;
         }
       else 
         {
@@ -337,6 +344,14 @@ inode_allow_write (struct inode *inode)
   inode->deny_write_cnt--;
 }
 
+/* Returns true if writes to INODE are currently denied, so that
+   its contents cannot change while it stays that way. */
+bool
+inode_writes_denied (const struct inode *inode)
+{
+  return inode->deny_write_cnt > 0;
+}
+
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode)
@@ -28,7 +28,22 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_FORK,                   /* Duplicate this process. */
+    SYS_SBRK,                   /* Move the end of the heap. */
+    SYS_MADVISE                 /* Tell how memory will be used. */
+  };
+
+/* Advice for SYS_MADVISE. */
+enum
+  {
+    MADV_NORMAL,                /* No particular access pattern. */
+    MADV_RANDOM,                /* Random access: no read-ahead. */
+    MADV_SEQUENTIAL,            /* Read ahead, let the pages behind go. */
+    MADV_WILLNEED,              /* Read the pages in now. */
+    MADV_DONTNEED               /* Release the pages. */
   };
 
 #endif /* lib/syscall-nr.h */
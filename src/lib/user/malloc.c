@@ -0,0 +1,230 @@
+#include <malloc.h>
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+
+/* A simple allocator for user programs.
+
+   The heap is the area between the end of the data segments and
+   the break, which sbrk() moves.  It is carved into blocks, each
+   preceded by a header that holds its size.  Free blocks are kept
+   on a list in address order, so that free() can merge a block
+   with the free blocks right before and after it.  malloc() takes
+   the first free block that is big enough and splits off the
+   rest.
+
+   The heap grows by at least HEAP_GROW bytes at a time, so that
+   small allocations do not each cost a system call.  The kernel
+   hands out the new pages zero-filled on first touch.  When the
+   free block at the top of the heap grows beyond HEAP_TRIM bytes,
+   free() gives it back with a negative sbrk(). */
+
+/* Block header. */
+struct block
+  {
+    size_t size;                /* Size in bytes, header included. */
+    struct block *next;         /* Next free block, if free. */
+  };
+
+#define ALIGN sizeof (struct block)     /* Alignment of every block. */
+#define MIN_BLOCK (2 * ALIGN)           /* Smallest block worth splitting. */
+#define HEAP_GROW (64 * 1024)           /* Least the heap grows by. */
+#define HEAP_TRIM (256 * 1024)          /* Free top block given back. */
+
+/* Free blocks, in address order. */
+static struct block *free_list;
+
+/* Returns the block right after B. */
+static struct block *
+block_end (struct block *b)
+{
+  return (struct block *) ((uint8_t *) b + b->size);
+}
+
+/* Puts B on the free list, merged with its free neighbours, and
+   returns the free block that holds it. */
+static struct block *
+insert_free (struct block *b)
+{
+  struct block *prev = NULL, *next = free_list;
+
+  while (next != NULL && next < b)
+    {
+      prev = next;
+      next = next->next;
+    }
+
+  b->next = next;
+  if (next != NULL && block_end (b) == next)
+    {
+      b->size += next->size;
+      b->next = next->next;
+    }
+  if (prev != NULL && block_end (prev) == b)
+    {
+      prev->size += b->size;
+      prev->next = b->next;
+      return prev;
+    }
+  if (prev != NULL)
+    prev->next = b;
+  else
+    free_list = b;
+  return b;
+}
+
+/* Takes B, which comes right after PREV on the free list (or is
+   its head if PREV is null), off the free list. */
+static void
+remove_free (struct block *prev, struct block *b)
+{
+  if (prev != NULL)
+    prev->next = b->next;
+  else
+    free_list = b->next;
+}
+
+/* Grows the heap by a block of at least SIZE bytes and puts it on
+   the free list.  Returns false if the kernel refuses. */
+static bool
+grow_heap (size_t size)
+{
+  size_t grow = size > HEAP_GROW ? size : HEAP_GROW;
+  struct block *b;
+
+  if (size > (size_t) INTPTR_MAX)
+    return false;
+  b = sbrk (grow);
+
+  if (b == (void *) -1)
+    {
+      grow = size;
+      b = sbrk (grow);
+      if (b == (void *) -1)
+        return false;
+    }
+  b->size = grow;
+  insert_free (b);
+  return true;
+}
+
+/* Gives the free block B back to the kernel if it sits at the top
+   of the heap and is bigger than HEAP_TRIM. */
+static void
+trim_heap (struct block *b)
+{
+  struct block *prev;
+
+  if (b->size <= HEAP_TRIM || b->next != NULL || block_end (b) != sbrk (0))
+    return;
+
+  for (prev = free_list; prev != b && prev->next != b; prev = prev->next)
+    continue;
+  remove_free (prev != b ? prev : NULL, b);
+  sbrk (-(intptr_t) b->size);
+}
+
+/* Obtains and returns a new block of at least SIZE bytes.
+   Returns a null pointer if memory is not available. */
+void *
+malloc (size_t size)
+{
+  struct block *prev, *b;
+  size_t need;
+
+  if (size == 0 || size > SIZE_MAX - 2 * ALIGN)
+    return NULL;
+  need = ROUND_UP (size + sizeof (struct block), ALIGN);
+
+  for (;;)
+    {
+      for (prev = NULL, b = free_list; b != NULL; prev = b, b = b->next)
+        if (b->size >= need)
+          {
+            if (b->size - need >= MIN_BLOCK)
+              {
+                /* Split off the rest, which stays free in place. */
+                struct block *rest = (struct block *) ((uint8_t *) b + need);
+                rest->size = b->size - need;
+                rest->next = b->next;
+                b->size = need;
+                b->next = rest;
+              }
+            remove_free (prev, b);
+            return b + 1;
+          }
+
+      if (!grow_heap (need))
+        return NULL;
+    }
+}
+
+/* Allocates and return A times B bytes initialized to zeroes.
+   Returns a null pointer if memory is not available. */
+void *
+calloc (size_t a, size_t b)
+{
+  void *p;
+  size_t size;
+
+  size = a * b;
+  if (b != 0 && size / b != a)
+    return NULL;
+
+  p = malloc (size);
+  if (p != NULL)
+    memset (p, 0, size);
+  return p;
+}
+
+/* Attempts to resize OLD_BLOCK to NEW_SIZE bytes, possibly moving
+   it in the process.
+   If successful, returns the new block; on failure, returns a
+   null pointer.
+   A call with null OLD_BLOCK is equivalent to malloc(NEW_SIZE).
+   A call with zero NEW_SIZE is equivalent to free(OLD_BLOCK). */
+void *
+realloc (void *old_block, size_t new_size)
+{
+  struct block *b;
+  size_t old_size;
+  void *new_block;
+
+  if (new_size == 0)
+    {
+      free (old_block);
+      return NULL;
+    }
+  if (old_block == NULL)
+    return malloc (new_size);
+
+  b = (struct block *) old_block - 1;
+  old_size = b->size - sizeof (struct block);
+  if (new_size <= old_size)
+    return old_block;
+
+  new_block = malloc (new_size);
+  if (new_block != NULL)
+    {
+      memcpy (new_block, old_block, old_size);
+      free (old_block);
+    }
+  return new_block;
+}
+
+/* Frees block P, which must have been previously allocated with
+   malloc(), calloc(), or realloc(). */
+void
+free (void *p)
+{
+  struct block *b;
+
+  if (p == NULL)
+    return;
+
+  b = (struct block *) p - 1;
+  ASSERT (b->size >= MIN_BLOCK && b->size % ALIGN == 0);
+  trim_heap (insert_free (b));
+}
@@ -2,7 +2,10 @@
 #define __LIB_USER_SYSCALL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <debug.h>
+#include <syscall-nr.h>         /* For MADV_*. */
 
 /* Process identifier. */
 typedef int pid_t;
@@ -45,4 +48,9 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+pid_t fork (void);
+void *sbrk (intptr_t increment);
+int madvise (void *addr, size_t length, int advice);
+
 #endif /* lib/user/syscall.h */
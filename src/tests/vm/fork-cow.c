@@ -0,0 +1,45 @@
+/* Forks with a 64 kB buffer in the data segment and has the child
+   rewrite it, to verify that the child starts from a copy of the
+   parent's data, sees its own writes, and leaves the parent's copy
+   alone. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (64 * 1024)
+
+static char buf[SIZE];
+
+void
+test_main (void)
+{
+  pid_t child;
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    buf[i] = i % 251;
+
+  msg ("fork");
+  child = fork ();
+  if (child == 0)
+    {
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != (char) (i % 251))
+          fail ("child sees bad data at offset %zu", i);
+      memset (buf, 0x5a, SIZE);
+      for (i = 0; i < SIZE; i++)
+        if (buf[i] != 0x5a)
+          fail ("child lost its write at offset %zu", i);
+      exit (81);
+    }
+  if (child == PID_ERROR)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 81, "wait for child");
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != (char) (i % 251))
+      fail ("parent sees the child's write at offset %zu", i);
+  msg ("parent's data intact");
+}
@@ -0,0 +1,74 @@
+/* Allocates blocks of many sizes with malloc(), a megabyte and
+   more in all, to verify that the heap grows on demand, that
+   blocks do not overlap, that realloc() keeps their contents and
+   that calloc() zeroes them, and that freeing every block gives
+   the heap back to the kernel. */
+
+#include <malloc.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define BLOCK_CNT 64
+
+static char *blocks[BLOCK_CNT];
+static size_t sizes[BLOCK_CNT];
+
+static void
+check_block (int i, size_t size)
+{
+  size_t j;
+
+  for (j = 0; j < size; j++)
+    if (blocks[i][j] != (char) i)
+      fail ("block %d has bad data at offset %zu", i, j);
+}
+
+void
+test_main (void)
+{
+  void *start = sbrk (0);
+  int *zero;
+  int i;
+
+  msg ("malloc");
+  for (i = 0; i < BLOCK_CNT; i++)
+    {
+      sizes[i] = (i * 7919) % 32768 + 1;
+      blocks[i] = malloc (sizes[i]);
+      if (blocks[i] == NULL)
+        fail ("malloc of %zu bytes failed", sizes[i]);
+      memset (blocks[i], i, sizes[i]);
+    }
+  for (i = 0; i < BLOCK_CNT; i++)
+    check_block (i, sizes[i]);
+
+  msg ("realloc");
+  for (i = 0; i < BLOCK_CNT; i += 2)
+    {
+      blocks[i] = realloc (blocks[i], sizes[i] * 2);
+      if (blocks[i] == NULL)
+        fail ("realloc to %zu bytes failed", sizes[i] * 2);
+      check_block (i, sizes[i]);
+      sizes[i] *= 2;
+      memset (blocks[i], i, sizes[i]);
+    }
+  for (i = 0; i < BLOCK_CNT; i++)
+    check_block (i, sizes[i]);
+
+  msg ("calloc");
+  zero = calloc (16384, sizeof *zero);
+  if (zero == NULL)
+    fail ("calloc failed");
+  for (i = 0; i < 16384; i++)
+    if (zero[i] != 0)
+      fail ("calloc'd memory not zeroed at %d", i);
+  free (zero);
+
+  msg ("free");
+  for (i = 0; i < BLOCK_CNT; i++)
+    free (blocks[i]);
+  if (sbrk (0) != start)
+    fail ("heap not given back");
+}
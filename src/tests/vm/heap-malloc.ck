@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(heap-malloc) begin
+(heap-malloc) malloc
+(heap-malloc) realloc
+(heap-malloc) calloc
+(heap-malloc) free
+(heap-malloc) end
+EOF
+pass;
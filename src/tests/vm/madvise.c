@@ -0,0 +1,53 @@
+/* Gives every kind of madvise() advice for a file mapping and for
+   memory in the data segment, to verify that the advice is accepted
+   for mapped memory, refused otherwise, and that MADV_DONTNEED
+   brings back the file's data or zeros. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (16 * 4096)
+
+static char buf[SIZE] __attribute__ ((aligned (4096)));
+
+void
+test_main (void)
+{
+  char *actual = (char *) 0x10000000;
+  int handle;
+  mapid_t map;
+  size_t i;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK ((map = mmap (handle, actual)) != MAP_FAILED, "mmap \"sample.txt\"");
+
+  CHECK (madvise (actual, 4096, MADV_SEQUENTIAL) == 0, "madvise sequential");
+  CHECK (madvise (actual, 4096, MADV_WILLNEED) == 0, "madvise willneed");
+  if (memcmp (actual, sample, strlen (sample)))
+    fail ("read of mmap'd file reported bad data");
+
+  /* Writes to the mapping are written back before they go. */
+  actual[0] = '*';
+  CHECK (madvise (actual, 4096, MADV_DONTNEED) == 0, "madvise dontneed mmap");
+  if (actual[0] != '*' || memcmp (actual + 1, sample + 1, strlen (sample) - 1))
+    fail ("mmap'd file lost data over MADV_DONTNEED");
+  actual[0] = sample[0];
+  munmap (map);
+
+  /* Released anonymous memory comes back zeroed. */
+  CHECK (madvise (buf, SIZE, MADV_RANDOM) == 0, "madvise random");
+  memset (buf, 0xcc, SIZE);
+  CHECK (madvise (buf, SIZE, MADV_DONTNEED) == 0, "madvise dontneed data");
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != 0)
+      fail ("byte %zu not zero after MADV_DONTNEED", i);
+  CHECK (madvise (buf, SIZE, MADV_NORMAL) == 0, "madvise normal");
+
+  CHECK (madvise (actual, 4096, MADV_WILLNEED) == -1, "madvise unmapped");
+  CHECK (madvise (buf + 1, 4096, MADV_WILLNEED) == -1, "madvise misaligned");
+  CHECK (madvise (buf, 4096, 99) == -1, "madvise bad advice");
+  close (handle);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(madvise) begin
+(madvise) open "sample.txt"
+(madvise) mmap "sample.txt"
+(madvise) madvise sequential
+(madvise) madvise willneed
+(madvise) madvise dontneed mmap
+(madvise) madvise random
+(madvise) madvise dontneed data
+(madvise) madvise normal
+(madvise) madvise unmapped
+(madvise) madvise misaligned
+(madvise) madvise bad advice
+(madvise) end
+EOF
+pass;
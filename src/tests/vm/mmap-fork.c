@@ -0,0 +1,51 @@
+/* Maps a file and forks.  The child overwrites its copy of the
+   mapping and unmaps it, then the parent writes to its own copy and
+   unmaps it, to verify that only the parent's write reaches the
+   file: the child gets a private copy of the mapping. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static const char parent_data[] = "written by the parent";
+
+void
+test_main (void)
+{
+  char *actual = (char *) 0x54321000;
+  char buf[sizeof sample];
+  mapid_t map;
+  int handle;
+  pid_t child;
+
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK ((map = mmap (handle, actual)) != MAP_FAILED, "mmap \"sample.txt\"");
+
+  msg ("fork");
+  child = fork ();
+  if (child == 0)
+    {
+      memset (actual, 'c', strlen (sample));
+      munmap (map);
+      exit (81);
+    }
+  if (child == PID_ERROR)
+    fail ("fork failed");
+
+  CHECK (wait (child) == 81, "wait for child");
+  if (memcmp (actual, sample, strlen (sample)))
+    fail ("parent sees the child's write");
+  memcpy (actual, parent_data, strlen (parent_data));
+  munmap (map);
+
+  CHECK (read (handle, buf, strlen (sample)) == (int) strlen (sample),
+         "read \"sample.txt\"");
+  if (memcmp (buf, parent_data, strlen (parent_data))
+      || memcmp (buf + strlen (parent_data), sample + strlen (parent_data),
+                 strlen (sample) - strlen (parent_data)))
+    fail ("file does not hold the parent's write alone");
+  msg ("file holds the parent's write alone");
+  close (handle);
+}
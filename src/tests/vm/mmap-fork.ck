@@ -0,0 +1,15 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(mmap-fork) begin
+(mmap-fork) open "sample.txt"
+(mmap-fork) mmap "sample.txt"
+(mmap-fork) fork
+(mmap-fork) wait for child
+(mmap-fork) read "sample.txt"
+(mmap-fork) file holds the parent's write alone
+(mmap-fork) end
+EOF
+pass;
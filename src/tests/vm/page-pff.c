@@ -0,0 +1,41 @@
+/* Runs 4 child-linear processes at once, which together need
+   more memory than there is, while this process keeps using a
+   small working set of its own, as an interactive process would,
+   and checks after each pass over it that it is still intact. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 4
+#define WS_SIZE (64 * 1024)     /* Size of the working set. */
+#define PASS_CNT 32             /* Passes over the working set. */
+
+static unsigned char ws[WS_SIZE];
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  size_t i;
+  int pass;
+
+  for (i = 0; i < WS_SIZE; i++)
+    ws[i] = i;
+
+  for (i = 0; i < CHILD_CNT; i++)
+    CHECK ((children[i] = exec ("child-linear")) != -1,
+           "exec \"child-linear\"");
+
+  msg ("use working set");
+  for (pass = 0; pass < PASS_CNT; pass++)
+    for (i = 0; i < WS_SIZE; i++)
+      {
+        if (ws[i] != (unsigned char) (i + pass))
+          fail ("byte %zu is %d in pass %d", i, ws[i], pass);
+        ws[i]++;
+      }
+
+  for (i = 0; i < CHILD_CNT; i++)
+    CHECK (wait (children[i]) == 0x42, "wait for child %zu", i);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(page-pff) begin
+(page-pff) exec "child-linear"
+(page-pff) exec "child-linear"
+(page-pff) exec "child-linear"
+(page-pff) exec "child-linear"
+(page-pff) use working set
+(page-pff) wait for child 0
+(page-pff) wait for child 1
+(page-pff) wait for child 2
+(page-pff) wait for child 3
+(page-pff) end
+EOF
+pass;
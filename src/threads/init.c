@@ -19,9 +19,11 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/mprof.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
 #include "threads/thread.h"
+#include "threads/vmalloc.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #include "userprog/exception.h"
@@ -39,11 +41,26 @@
 #endif
 #ifdef VM
 #include "vm/frame.h"
+#include "vm/swap.h"
+#include "vm/vm_area.h"
+#include "vm/zswap.h"
+#include "vm/fault.h"
 #endif
 
 /* Page directory with kernel mappings only. */
 uint32_t *init_page_dir;
 
+/* PTE_G if kernel mappings are global, otherwise 0. */
+uint32_t init_pte_global;
+
+/* CPUID leaf 1 feature flags in EDX, and CR4 bits.  See [IA32-v2a]
+   "CPUID--CPU Identification" and [IA32-v3a] 2.5 "Control
+   Registers". */
+#define CPUID_PSE (1u << 3)     /* 4 MB pages supported. */
+#define CPUID_PGE (1u << 13)    /* Global pages supported. */
+#define CR4_PSE (1u << 4)       /* 4 MB pages enabled. */
+#define CR4_PGE (1u << 7)       /* Global pages enabled. */
+
 #ifdef FILESYS
 /* -f: Format the file system? */
 static bool format_filesys;
@@ -54,12 +71,36 @@ static const char *filesys_bdev_name;
 static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
+
+/* -zswap: Size of the compressed swap cache in pages, SIZE_MAX to
+   size it from the amount of memory. */
+static size_t zswap_pages = SIZE_MAX;
+
+/* -low-wmark, -high-wmark: Free user page counts between which
+   the reclaim thread keeps memory, SIZE_MAX for the defaults. */
+static size_t low_wmark = SIZE_MAX;
+static size_t high_wmark = SIZE_MAX;
+
+/* -pff: Ticks of running time between page faults below which a
+   process may grow its working set, 0 to disable, SIZE_MAX for the
+   default. */
+static size_t pff_ticks = SIZE_MAX;
+
+/* -stack-limit: Most kB of stack a user process may grow to,
+   SIZE_MAX for the default. */
+static size_t stack_limit_kb = SIZE_MAX;
+
+/* -fault-stats: Print page fault statistics of each process? */
+static bool fault_stats;
 #endif
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
 static size_t user_page_limit = SIZE_MAX;
 
+/* -small-pages: Map kernel memory with 4 kB pages only? */
+static bool small_pages;
+
 static void bss_init (void);
 static void paging_init (void);
 
@@ -98,9 +139,11 @@ main (void)
           init_ram_pages * PGSIZE / 1024);
 
   /* Initialize memory system. */
+  mprof_init ();
   palloc_init (user_page_limit);
   malloc_init ();
   paging_init ();
+  vmalloc_init ();
 #ifdef VM
   frame_table_init();
 #endif
@@ -131,6 +174,14 @@ main (void)
   ide_init ();
   locate_block_devices ();
   filesys_init (format_filesys);
+#ifdef VM
+  swap_init ();
+  zswap_init (zswap_pages);
+  frame_table_start_reclaim (low_wmark, high_wmark);
+  frame_table_set_pff (pff_ticks);
+  vm_area_set_stack_limit (stack_limit_kb);
+  fault_set_per_process (fault_stats);
+#endif
 #endif
 
   printf ("Boot complete.\n");
@@ -156,16 +207,53 @@ bss_init (void)
   memset (&_start_bss, 0, &_end_bss - &_start_bss);
 }
 
-/* Populates the base page directory and page table with the
+/* Returns the feature flags that CPUID leaf 1 reports in EDX. */
+static uint32_t
+cpu_features (void)
+{
+  uint32_t eax = 1, ebx, ecx, edx;
+
+  asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+  return edx;
+}
+
+/* Returns true if the 4 MB of kernel virtual memory starting at
+   VADDR hold any kernel code, which must stay read-only. */
+static bool
+holds_kernel_text (const char *vaddr)
+{
+  extern char _start, _end_kernel_text;
+  return vaddr < &_end_kernel_text && &_start < vaddr + PTSPAN;
+}
+
+/* Populates the base page directory and page tables with the
    kernel virtual mapping, and then sets up the CPU to use the
    new page directory.  Points init_page_dir to the page
-   directory it creates. */
+   directory it creates.
+
+   If the CPU supports them, every 4 MB of RAM that holds no
+   kernel code is mapped with a single 4 MB page, which needs no
+   page table and only one TLB entry.  The rest, at most the first
+   and the last 4 MB, is mapped with 4 kB pages.
+
+   If the CPU supports it, the kernel mappings are also global, so
+   that the CR3 loads of context switches between processes keep
+   their TLB entries.  Every page directory shares them, and they
+   never change except in vmalloc(), which drops stale entries with
+   invlpg. */
 static void
 paging_init (void)
 {
   uint32_t *pd, *pt;
   size_t page;
+  size_t large_cnt = 0, pt_cnt = 0;
   extern char _start, _end_kernel_text;
+  uint32_t features = cpu_features ();
+  bool pse = !small_pages && (features & CPUID_PSE) != 0;
+  uint32_t cr4;
+
+  if (features & CPUID_PGE)
+    init_pte_global = PTE_G;
 
   pd = init_page_dir = palloc_get_page (PAL_ASSERT | PAL_ZERO);
   pt = NULL;
@@ -177,13 +265,33 @@ paging_init (void)
       size_t pte_idx = pt_no (vaddr);
       bool in_kernel_text = &_start <= vaddr && vaddr < &_end_kernel_text;
 
+      if (pse && pte_idx == 0 && page + (1 << PTBITS) <= init_ram_pages
+          && !holds_kernel_text (vaddr))
+        {
+          pd[pde_idx] = paddr | PTE_PS | PTE_P | PTE_W | init_pte_global;
+          page += (1 << PTBITS) - 1;
+          large_cnt++;
+          continue;
+        }
+
       if (pd[pde_idx] == 0)
         {
           pt = palloc_get_page (PAL_ASSERT | PAL_ZERO);
           pd[pde_idx] = pde_create (pt);
+          pt_cnt++;
         }
 
-      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text);
+      pt[pte_idx] = pte_create_kernel (vaddr, !in_kernel_text)
+                    | init_pte_global;
+    }
+
+  /* 4 MB pages must be enabled before the page directory that
+     uses them is loaded. */
+  asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+  if (pse)
+    {
+      cr4 |= CR4_PSE;
+      asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
     }
 
   /* Store the physical address of the page directory into CR3
@@ -192,6 +300,18 @@ paging_init (void)
      to/from Control Registers" and [IA32-v3a] 3.7.5 "Base Address
      of the Page Directory". */
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (init_page_dir)));
+
+  /* Turn global pages on only now, so that none of the boot page
+     tables' entries stay in the TLB. */
+  if (init_pte_global)
+    {
+      cr4 |= CR4_PGE;
+      asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+    }
+
+  printf ("Kernel map: %zu 4 MB pages, %zu page tables (%zu kB)%s.\n",
+          large_cnt, pt_cnt, pt_cnt * PGSIZE / 1024,
+          init_pte_global ? ", global" : "");
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -256,12 +376,28 @@ parse_options (char **argv)
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
+      else if (!strcmp (name, "-zswap"))
+        zswap_pages = atoi (value);
+      else if (!strcmp (name, "-low-wmark"))
+        low_wmark = atoi (value);
+      else if (!strcmp (name, "-high-wmark"))
+        high_wmark = atoi (value);
+      else if (!strcmp (name, "-pff"))
+        pff_ticks = atoi (value);
+      else if (!strcmp (name, "-stack-limit"))
+        stack_limit_kb = atoi (value);
+      else if (!strcmp (name, "-fault-stats"))
+        fault_stats = true;
 #endif
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-mprof"))
+        mprof_enabled = true;
+      else if (!strcmp (name, "-small-pages"))
+        small_pages = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -298,6 +434,14 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+/* Prints kernel memory allocation statistics. */
+static void
+run_mprof (char **argv UNUSED)
+{
+  palloc_print_stats ();
+  mprof_print_stats ();
+}
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -315,6 +459,7 @@ run_actions (char **argv)
   static const struct action actions[] = 
     {
       {"run", 2, run_task},
+      {"mprof", 1, run_mprof},
 #ifdef FILESYS
       {"ls", 1, fsutil_ls},
       {"cat", 2, fsutil_cat},
@@ -363,6 +508,7 @@ usage (void)
 #else
           "  run TEST           Run TEST.\n"
 #endif
+          "  mprof              Print memory allocation statistics.\n"
 #ifdef FILESYS
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
@@ -381,10 +527,24 @@ usage (void)
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
+          "  -zswap=COUNT       Keep up to COUNT pages of compressed swap\n"
+          "                     in RAM (0 to disable).\n"
+          "  -low-wmark=COUNT   Reclaim memory in the background when\n"
+          "                     fewer than COUNT user pages are free\n"
+          "                     (0 to disable).\n"
+          "  -high-wmark=COUNT  Stop reclaiming at COUNT free pages.\n"
+          "  -pff=TICKS         Let processes that fault within TICKS\n"
+          "                     ticks grow their working sets, shrink\n"
+          "                     the others (0 to disable).\n"
+          "  -stack-limit=KB    Let user stacks grow to at most KB kB.\n"
+          "  -fault-stats       Print page fault statistics of each\n"
+          "                     process at exit.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -mprof             Profile kernel memory allocations.\n"
+          "  -small-pages       Map kernel memory with 4 kB pages only.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
@@ -9,4 +9,7 @@
 /* Page directory with kernel mappings only. */
 extern uint32_t *init_page_dir;
 
+/* PTE_G if kernel mappings are global, otherwise 0. */
+extern uint32_t init_pte_global;
+
 #endif /* threads/init.h */
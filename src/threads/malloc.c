@@ -5,9 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/mprof.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "threads/vmalloc.h"
 
 /* A simple implementation of malloc().
 
@@ -32,7 +34,15 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.  If the
+   kernel pool is too fragmented to supply that many contiguous
+   pages, we fall back to vmalloc(), which only needs the pages to
+   be contiguous in virtual memory.
+
+   When allocation profiling is enabled (see mprof.h), every
+   block is preceded by a tag recording who asked for it and how
+   many bytes they asked for, so that free() can credit the right
+   call site. */
 
 /* Descriptor. */
 struct desc
@@ -60,12 +70,22 @@ struct block
     struct list_elem free_elem; /* Free list element. */
   };
 
+/* Profiling tag, stored just before each block handed out
+   while mprof_enabled is true. */
+struct mprof_tag
+  {
+    const void *caller;         /* Return address into the caller. */
+    size_t size;                /* Requested size in bytes. */
+  };
+
 /* Our set of descriptors. */
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void *malloc_block (size_t);
+static void *malloc_tagged (size_t, const void *caller);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -88,6 +108,35 @@ malloc_init (void)
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) 
+{
+  return malloc_tagged (size, __builtin_return_address (0));
+}
+
+/* Like malloc(), but if profiling is enabled, charges the
+   allocation to CALLER. */
+static void *
+malloc_tagged (size_t size, const void *caller)
+{
+  struct mprof_tag *tag;
+
+  if (!mprof_enabled)
+    return malloc_block (size);
+  if (size == 0)
+    return NULL;
+
+  tag = malloc_block (size + sizeof *tag);
+  if (tag == NULL)
+    return NULL;
+  tag->caller = caller;
+  tag->size = size;
+  mprof_alloc (MPROF_MALLOC, caller, size);
+  return tag + 1;
+}
+
+/* Obtains and returns a new block of at least SIZE bytes,
+   without any profiling tag. */
+static void *
+malloc_block (size_t size) 
 {
   struct desc *d;
   struct block *b;
@@ -108,6 +157,8 @@ malloc (size_t size)
          Allocate enough pages to hold SIZE plus an arena. */
       size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
       a = palloc_get_multiple (0, page_cnt);
+      if (a == NULL && page_cnt > 1)
+        a = vmalloc (page_cnt * PGSIZE);
       if (a == NULL)
         return NULL;
 
@@ -167,7 +218,7 @@ calloc (size_t a, size_t b)
     return NULL;
 
   /* Allocate and zero memory. */
-  p = malloc (size);
+  p = malloc_tagged (size, __builtin_return_address (0));
   if (p != NULL)
     memset (p, 0, size);
 
@@ -179,9 +230,15 @@ static size_t
 block_size (void *block) 
 {
   struct block *b = block;
-  struct arena *a = block_to_arena (b);
-  struct desc *d = a->desc;
+  struct arena *a;
+  struct desc *d;
 
+  /* With profiling on, report the size originally asked for. */
+  if (mprof_enabled)
+    return ((struct mprof_tag *) block - 1)->size;
+
+  a = block_to_arena (b);
+  d = a->desc;
   return d != NULL ? d->block_size : PGSIZE * a->free_cnt - pg_ofs (block);
 }
 
@@ -201,7 +258,8 @@ realloc (void *old_block, size_t new_size)
     }
   else 
     {
-      void *new_block = malloc (new_size);
+      void *new_block = malloc_tagged (new_size,
+                                       __builtin_return_address (0));
       if (old_block != NULL && new_block != NULL)
         {
           size_t old_size = block_size (old_block);
@@ -218,6 +276,13 @@ realloc (void *old_block, size_t new_size)
 void
 free (void *p) 
 {
+  if (p != NULL && mprof_enabled)
+    {
+      struct mprof_tag *tag = (struct mprof_tag *) p - 1;
+      mprof_free (MPROF_MALLOC, tag->caller, tag->size);
+      p = tag;
+    }
+
   if (p != NULL)
     {
       struct block *b = p;
@@ -257,7 +322,10 @@ free (void *p)
       else
         {
           /* It's a big block.  Free its pages. */
-          palloc_free_multiple (a, a->free_cnt);
+          if (is_vmalloc_vaddr (a))
+            vfree (a);
+          else
+            palloc_free_multiple (a, a->free_cnt);
           return;
         }
     }
@@ -0,0 +1,191 @@
+#include "threads/mprof.h"
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "threads/synch.h"
+
+/* Allocation profiler.  See mprof.h for an overview.
+
+   Call sites live in a fixed-size open-addressed table per
+   allocator, so that recording an allocation never allocates
+   memory itself.  Sites that do not fit are lumped together in
+   an overflow entry with a null caller. */
+
+/* Number of call sites tracked per allocator. */
+#define SITE_CNT 256
+
+/* Number of size classes: class N holds requests of up to 2**N
+   bytes. */
+#define CLASS_CNT 32
+
+/* Live and cumulative counts for a call site or size class. */
+struct mprof_counts
+  {
+    size_t live_bytes;          /* Bytes currently allocated. */
+    size_t live_cnt;            /* Allocations currently live. */
+    size_t peak_bytes;          /* High-water mark of live_bytes. */
+    unsigned long long total_cnt; /* Allocations ever made. */
+  };
+
+/* A call site. */
+struct mprof_site
+  {
+    const void *caller;         /* Return address into the caller. */
+    struct mprof_counts counts;
+  };
+
+/* Per-allocator tables. */
+struct mprof_table
+  {
+    const char *name;
+    struct mprof_site sites[SITE_CNT];
+    struct mprof_site overflow;
+    struct mprof_counts classes[CLASS_CNT];
+  };
+
+bool mprof_enabled;
+
+static struct mprof_table tables[MPROF_ALLOCATOR_CNT];
+static struct lock mprof_lock;
+
+static struct mprof_site *find_site (struct mprof_table *, const void *);
+static size_t size_class (size_t bytes);
+static void count_alloc (struct mprof_counts *, size_t bytes);
+static void count_free (struct mprof_counts *, size_t bytes);
+
+/* Initializes the profiler.  Must be called before the first
+   allocation if mprof_enabled is set. */
+void
+mprof_init (void)
+{
+  lock_init (&mprof_lock);
+  tables[MPROF_MALLOC].name = "malloc";
+  tables[MPROF_PALLOC].name = "palloc";
+}
+
+/* Records an allocation of BYTES bytes by CALLER through
+   allocator A. */
+void
+mprof_alloc (enum mprof_allocator a, const void *caller, size_t bytes)
+{
+  struct mprof_table *t = &tables[a];
+
+  ASSERT (mprof_enabled);
+
+  lock_acquire (&mprof_lock);
+  count_alloc (&find_site (t, caller)->counts, bytes);
+  count_alloc (&t->classes[size_class (bytes)], bytes);
+  lock_release (&mprof_lock);
+}
+
+/* Records that an allocation of BYTES bytes by CALLER through
+   allocator A was freed. */
+void
+mprof_free (enum mprof_allocator a, const void *caller, size_t bytes)
+{
+  struct mprof_table *t = &tables[a];
+
+  ASSERT (mprof_enabled);
+
+  lock_acquire (&mprof_lock);
+  count_free (&find_site (t, caller)->counts, bytes);
+  count_free (&t->classes[size_class (bytes)], bytes);
+  lock_release (&mprof_lock);
+}
+
+/* Prints the call site and size class tables.  Call sites are
+   raw addresses; feed them to the "backtrace" utility to turn
+   them into function names. */
+void
+mprof_print_stats (void)
+{
+  size_t i, j;
+
+  if (!mprof_enabled)
+    return;
+
+  lock_acquire (&mprof_lock);
+  for (i = 0; i < MPROF_ALLOCATOR_CNT; i++)
+    {
+      const struct mprof_table *t = &tables[i];
+
+      printf ("Mprof: %s call sites (caller, live bytes, live, "
+              "peak bytes, total):\n", t->name);
+      for (j = 0; j < SITE_CNT; j++)
+        {
+          const struct mprof_site *s = &t->sites[j];
+          if (s->caller != NULL)
+            printf ("  %p %10zu %8zu %10zu %10llu\n", s->caller,
+                    s->counts.live_bytes, s->counts.live_cnt,
+                    s->counts.peak_bytes, s->counts.total_cnt);
+        }
+      if (t->overflow.counts.total_cnt > 0)
+        printf ("  (other)    %10zu %8zu %10zu %10llu\n",
+                t->overflow.counts.live_bytes, t->overflow.counts.live_cnt,
+                t->overflow.counts.peak_bytes, t->overflow.counts.total_cnt);
+
+      printf ("Mprof: %s size classes (up to bytes, live bytes, live, "
+              "peak bytes, total):\n", t->name);
+      for (j = 0; j < CLASS_CNT; j++)
+        {
+          const struct mprof_counts *c = &t->classes[j];
+          if (c->total_cnt > 0)
+            printf ("  %10zu %10zu %8zu %10zu %10llu\n", (size_t) 1 << j,
+                    c->live_bytes, c->live_cnt, c->peak_bytes, c->total_cnt);
+        }
+    }
+  lock_release (&mprof_lock);
+}
+
+/* Returns the entry for CALLER in T, creating it if necessary.
+   Falls back to the overflow entry when T is full. */
+static struct mprof_site *
+find_site (struct mprof_table *t, const void *caller)
+{
+  size_t start = ((uintptr_t) caller >> 2) % SITE_CNT;
+  size_t i;
+
+  for (i = 0; i < SITE_CNT; i++)
+    {
+      struct mprof_site *s = &t->sites[(start + i) % SITE_CNT];
+      if (s->caller == caller)
+        return s;
+      if (s->caller == NULL)
+        {
+          s->caller = caller;
+          return s;
+        }
+    }
+  return &t->overflow;
+}
+
+/* Returns the size class for a BYTES-byte allocation. */
+static size_t
+size_class (size_t bytes)
+{
+  size_t class = 0;
+
+  while (class < CLASS_CNT - 1 && ((size_t) 1 << class) < bytes)
+    class++;
+  return class;
+}
+
+/* Adds an allocation of BYTES bytes to C. */
+static void
+count_alloc (struct mprof_counts *c, size_t bytes)
+{
+  c->live_bytes += bytes;
+  c->live_cnt++;
+  c->total_cnt++;
+  if (c->live_bytes > c->peak_bytes)
+    c->peak_bytes = c->live_bytes;
+}
+
+/* Removes an allocation of BYTES bytes from C. */
+static void
+count_free (struct mprof_counts *c, size_t bytes)
+{
+  ASSERT (c->live_cnt > 0 && c->live_bytes >= bytes);
+  c->live_bytes -= bytes;
+  c->live_cnt--;
+}
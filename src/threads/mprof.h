@@ -0,0 +1,32 @@
+#ifndef THREADS_MPROF_H
+#define THREADS_MPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Kernel memory allocation profiler.
+
+   When enabled with the -mprof kernel command-line option,
+   malloc() and palloc_get_multiple() tag every allocation with
+   the return address of their caller, and the profiler keeps
+   live-byte and allocation counts per call site and per
+   power-of-two size class. */
+
+/* Allocators that report to the profiler. */
+enum mprof_allocator
+  {
+    MPROF_MALLOC,               /* malloc() and friends. */
+    MPROF_PALLOC,               /* palloc_get_page/multiple(). */
+    MPROF_ALLOCATOR_CNT
+  };
+
+/* If false (default), don't profile allocations.
+   Controlled by kernel command-line option "-mprof". */
+extern bool mprof_enabled;
+
+void mprof_init (void);
+void mprof_alloc (enum mprof_allocator, const void *caller, size_t bytes);
+void mprof_free (enum mprof_allocator, const void *caller, size_t bytes);
+void mprof_print_stats (void);
+
+#endif /* threads/mprof.h */
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/loader.h"
+#include "threads/mprof.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
@@ -22,23 +23,71 @@
    even if user processes are swapping like mad.
 
    By default, half of system RAM is given to the kernel pool and
-   half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   half to the user pool at boot.  That split is only a starting
+   point: when one pool runs dry it borrows runs of free pages
+   from the other, as long as the lender keeps at least its low
+   watermark of free pages.  A borrowed page goes back to its
+   home pool when it is freed while the borrower has more than
+   its high watermark of free pages.
+
+   Both pools cover the whole of free memory.  A pool's used_map
+   marks the pages it does not currently own as used, so it never
+   hands them out, and owner_map records which pool owns each
+   page.
+
+   When allocation profiling is enabled (see mprof.h), we also
+   remember the caller that allocated each run of pages, indexed
+   by the run's first page. */
+
+/* Preferred number of pages to move between pools at once. */
+#define LEND_PAGES 16
 
 /* A memory pool. */
 struct pool
   {
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
-    uint8_t *base;                      /* Base of pool. */
+    const char *name;                   /* Name, for statistics. */
+    size_t home_cnt;                    /* Pages assigned at boot. */
+    size_t owned_cnt;                   /* Pages currently owned. */
+    size_t max_cnt;                     /* Upper bound on owned_cnt. */
+    size_t used_cnt;                    /* Owned pages in use. */
+    size_t peak_cnt;                    /* High-water mark of used_cnt. */
+    size_t low_wmark;                   /* Free pages kept when lending. */
+    size_t high_wmark;                  /* Free pages before returning. */
+
+    /* Statistics. */
+    unsigned long long borrowed_cnt;    /* Pages borrowed. */
+    unsigned long long returned_cnt;    /* Borrowed pages given back. */
+    unsigned long long lent_cnt;        /* Pages lent to the other pool. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
-static void init_pool (struct pool *, void *base, size_t page_cnt,
-                       const char *name);
-static bool page_from_pool (const struct pool *, void *page);
+/* Base of the pages managed by the pools, and their number. */
+static uint8_t *pool_base;
+static size_t pool_page_cnt;
+
+/* Index of the first page whose home is the user pool. */
+static size_t user_home_idx;
+
+/* Bitmap of pages currently owned by the user pool. */
+static struct bitmap *owner_map;
+
+/* Allocating caller of each page, if profiling. */
+static const void **page_callers;
+
+static void init_pool (struct pool *, const char *name, size_t start,
+                       size_t page_cnt, size_t max_cnt);
+static void *get_multiple (enum palloc_flags, size_t page_cnt,
+                           const void *caller);
+static size_t take_pages (struct pool *, size_t page_cnt);
+static struct pool *page_owner (size_t page_idx);
+static struct pool *page_home (size_t page_idx);
+static bool pool_borrow (struct pool *, size_t page_cnt);
+static void lock_both_pools (void);
+static void unlock_both_pools (void);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -49,16 +98,44 @@ palloc_init (size_t user_page_limit)
   uint8_t *free_start = ptov (1024 * 1024);
   uint8_t *free_end = ptov (init_ram_pages * PGSIZE);
   size_t free_pages = (free_end - free_start) / PGSIZE;
-  size_t user_pages = free_pages / 2;
-  size_t kernel_pages;
+  size_t bm_bytes, bm_pages, user_pages, kernel_pages;
+
+  /* We'll put the bitmaps at the base of free memory: one used
+     map per pool plus the owner map, each covering every page,
+     then the table of callers if profiling.  Calculate the space
+     they need and subtract it. */
+  bm_bytes = 3 * bitmap_buf_size (free_pages);
+  if (mprof_enabled)
+    bm_bytes += free_pages * sizeof *page_callers;
+  bm_pages = DIV_ROUND_UP (bm_bytes, PGSIZE);
+  if (bm_pages > free_pages)
+    PANIC ("Not enough memory for page allocator bitmaps.");
+  pool_base = free_start + bm_pages * PGSIZE;
+  pool_page_cnt = free_pages - bm_pages;
+
+  user_pages = pool_page_cnt / 2;
   if (user_pages > user_page_limit)
     user_pages = user_page_limit;
-  kernel_pages = free_pages - user_pages;
+  kernel_pages = pool_page_cnt - user_pages;
+  user_home_idx = kernel_pages;
+
+  kernel_pool.used_map = bitmap_create_in_buf (pool_page_cnt, free_start,
+                                               bitmap_buf_size (pool_page_cnt));
+  user_pool.used_map = bitmap_create_in_buf (
+    pool_page_cnt, free_start + bitmap_buf_size (pool_page_cnt),
+    bitmap_buf_size (pool_page_cnt));
+  owner_map = bitmap_create_in_buf (
+    pool_page_cnt, free_start + 2 * bitmap_buf_size (pool_page_cnt),
+    bitmap_buf_size (pool_page_cnt));
+  bitmap_set_multiple (owner_map, user_home_idx, user_pages, true);
+  if (mprof_enabled)
+    page_callers = (const void **) (free_start
+                                    + 3 * bitmap_buf_size (pool_page_cnt));
 
   /* Give half of memory to kernel, half to user. */
-  init_pool (&kernel_pool, free_start, kernel_pages, "kernel pool");
-  init_pool (&user_pool, free_start + kernel_pages * PGSIZE,
-             user_pages, "user pool");
+  init_pool (&kernel_pool, "kernel pool", 0, kernel_pages, pool_page_cnt);
+  init_pool (&user_pool, "user pool", user_home_idx, user_pages,
+             user_page_limit);
 }
 
 /* Obtains and returns a group of PAGE_CNT contiguous free pages.
@@ -69,6 +146,14 @@ palloc_init (size_t user_page_limit)
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
+{
+  return get_multiple (flags, page_cnt, __builtin_return_address (0));
+}
+
+/* Implements palloc_get_multiple(), charging the pages to CALLER
+   if profiling. */
+static void *
+get_multiple (enum palloc_flags flags, size_t page_cnt, const void *caller)
 {
   struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
   void *pages;
@@ -77,12 +162,14 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
   if (page_cnt == 0)
     return NULL;
 
-  lock_acquire (&pool->lock);
-  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-  lock_release (&pool->lock);
+  page_idx = take_pages (pool, page_cnt);
+
+  /* Out of pages: try to borrow some from the other pool. */
+  if (page_idx == BITMAP_ERROR && pool_borrow (pool, page_cnt))
+    page_idx = take_pages (pool, page_cnt);
 
   if (page_idx != BITMAP_ERROR)
-    pages = pool->base + PGSIZE * page_idx;
+    pages = pool_base + PGSIZE * page_idx;
   else
     pages = NULL;
 
@@ -90,6 +177,11 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
     {
       if (flags & PAL_ZERO)
         memset (pages, 0, PGSIZE * page_cnt);
+      if (mprof_enabled)
+        {
+          page_callers[page_idx] = caller;
+          mprof_alloc (MPROF_PALLOC, caller, PGSIZE * page_cnt);
+        }
     }
   else 
     {
@@ -110,7 +202,7 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 void *
 palloc_get_page (enum palloc_flags flags) 
 {
-  return palloc_get_multiple (flags, 1);
+  return get_multiple (flags, 1, __builtin_return_address (0));
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
@@ -118,27 +210,65 @@ void
 palloc_free_multiple (void *pages, size_t page_cnt) 
 {
   struct pool *pool;
-  size_t page_idx;
+  size_t page_idx, i;
+  bool borrowed = false;
 
   ASSERT (pg_ofs (pages) == 0);
   if (pages == NULL || page_cnt == 0)
     return;
 
-  if (page_from_pool (&kernel_pool, pages))
-    pool = &kernel_pool;
-  else if (page_from_pool (&user_pool, pages))
-    pool = &user_pool;
-  else
-    NOT_REACHED ();
+  ASSERT ((uint8_t *) pages >= pool_base);
+  page_idx = pg_no (pages) - pg_no (pool_base);
+  ASSERT (page_idx + page_cnt <= pool_page_cnt);
 
-  page_idx = pg_no (pages) - pg_no (pool->base);
+  /* Ownership of pages in use cannot change under us, since only
+     free pages are ever lent or returned. */
+  pool = page_owner (page_idx);
+  for (i = 0; i < page_cnt; i++)
+    {
+      ASSERT (page_owner (page_idx + i) == pool);
+      if (page_home (page_idx + i) != pool)
+        borrowed = true;
+    }
 
 #ifndef NDEBUG
   memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
+  if (mprof_enabled)
+    mprof_free (MPROF_PALLOC, page_callers[page_idx], PGSIZE * page_cnt);
+
+  if (!borrowed)
+    {
+      lock_acquire (&pool->lock);
+      ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+      bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+      pool->used_cnt -= page_cnt;
+      lock_release (&pool->lock);
+      return;
+    }
+
+  /* Some of the pages were borrowed.  Give them back to their
+     home pool if we have plenty of free pages of our own. */
+  lock_both_pools ();
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+  pool->used_cnt -= page_cnt;
+  for (i = page_idx; i < page_idx + page_cnt; i++)
+    {
+      struct pool *home = page_home (i);
+      if (home != pool
+          && pool->owned_cnt - pool->used_cnt > pool->high_wmark)
+        {
+          bitmap_reset (home->used_map, i);
+          bitmap_set (owner_map, i, home == &user_pool);
+          pool->owned_cnt--;
+          home->owned_cnt++;
+          pool->returned_cnt++;
+        }
+      else
+        bitmap_reset (pool->used_map, i);
+    }
+  unlock_both_pools ();
 }
 
 /* Frees the page at PAGE. */
@@ -148,35 +278,176 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
-/* Initializes pool P as starting at START and ending at END,
-   naming it NAME for debugging purposes. */
-static void
-init_pool (struct pool *p, void *base, size_t page_cnt, const char *name) 
+/* Returns roughly how many more single pages allocations with
+   FLAGS can get: the free pages of the pool that PAL_USER selects,
+   plus what that pool could borrow from the other one. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
 {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
-     and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (page_cnt), PGSIZE);
-  if (bm_pages > page_cnt)
-    PANIC ("Not enough memory in %s for bitmap.", name);
-  page_cnt -= bm_pages;
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  struct pool *lender = pool == &user_pool ? &kernel_pool : &user_pool;
+  size_t free_cnt, lendable;
+
+  lock_both_pools ();
+  free_cnt = pool->owned_cnt - pool->used_cnt;
+  lendable = lender->owned_cnt - lender->used_cnt;
+  lendable = lendable > lender->low_wmark ? lendable - lender->low_wmark : 0;
+  if (lendable > pool->max_cnt - pool->owned_cnt)
+    lendable = pool->max_cnt - pool->owned_cnt;
+  unlock_both_pools ();
+
+  return free_cnt + lendable;
+}
+
+/* Returns the number of pages managed by the two pools. */
+size_t
+palloc_page_cnt (void)
+{
+  return pool_page_cnt;
+}
+
+/* Returns the number of PAGE, which must have come from one of
+   the pools, in the range 0...palloc_page_cnt() - 1. */
+size_t
+palloc_page_no (const void *page)
+{
+  ASSERT (pg_ofs (page) == 0);
+  ASSERT ((const uint8_t *) page >= pool_base);
+  ASSERT (pg_no (page) - pg_no (pool_base) < pool_page_cnt);
+  return pg_no (page) - pg_no (pool_base);
+}
+
+/* Returns the kernel virtual address of page number PAGE_NO. */
+void *
+palloc_page_addr (size_t page_no)
+{
+  ASSERT (page_no < pool_page_cnt);
+  return pool_base + page_no * PGSIZE;
+}
 
+/* Prints page allocator statistics. */
+void
+palloc_print_stats (void)
+{
+  const struct pool *pools[] = {&kernel_pool, &user_pool};
+  size_t i;
+
+  for (i = 0; i < sizeof pools / sizeof *pools; i++)
+    {
+      const struct pool *p = pools[i];
+      printf ("Palloc: %s owns %zu pages (%zu at boot), %zu in use "
+              "(peak %zu); %llu borrowed, %llu returned, %llu lent\n",
+              p->name, p->owned_cnt, p->home_cnt, p->used_cnt, p->peak_cnt,
+              p->borrowed_cnt, p->returned_cnt, p->lent_cnt);
+    }
+}
+
+/* Initializes pool P to own the PAGE_CNT pages starting at index
+   START, naming it NAME for debugging purposes.  The pool will
+   never own more than MAX_CNT pages. */
+static void
+init_pool (struct pool *p, const char *name, size_t start, size_t page_cnt,
+           size_t max_cnt)
+{
   printf ("%zu pages available in %s.\n", page_cnt, name);
 
-  /* Initialize the pool. */
   lock_init (&p->lock);
-  p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  bitmap_set_all (p->used_map, true);
+  bitmap_set_multiple (p->used_map, start, page_cnt, false);
+  p->name = name;
+  p->home_cnt = page_cnt;
+  p->owned_cnt = page_cnt;
+  p->max_cnt = max_cnt;
+  p->used_cnt = 0;
+  p->peak_cnt = 0;
+  p->low_wmark = page_cnt / 8;
+  p->high_wmark = page_cnt / 4 > LEND_PAGES ? page_cnt / 4 : LEND_PAGES;
+}
+
+/* Marks PAGE_CNT contiguous free pages of POOL as used and
+   returns the index of the first, or BITMAP_ERROR if POOL has no
+   such run. */
+static size_t
+take_pages (struct pool *pool, size_t page_cnt)
+{
+  size_t page_idx;
+
+  lock_acquire (&pool->lock);
+  page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (page_idx != BITMAP_ERROR)
+    {
+      pool->used_cnt += page_cnt;
+      if (pool->used_cnt > pool->peak_cnt)
+        pool->peak_cnt = pool->used_cnt;
+    }
+  lock_release (&pool->lock);
+
+  return page_idx;
 }
 
-/* Returns true if PAGE was allocated from POOL,
-   false otherwise. */
+/* Returns the pool that currently owns page PAGE_IDX. */
+static struct pool *
+page_owner (size_t page_idx)
+{
+  return bitmap_test (owner_map, page_idx) ? &user_pool : &kernel_pool;
+}
+
+/* Returns the pool that page PAGE_IDX was assigned to at boot. */
+static struct pool *
+page_home (size_t page_idx)
+{
+  return page_idx >= user_home_idx ? &user_pool : &kernel_pool;
+}
+
+/* Moves a run of at least PAGE_CNT contiguous free pages from the
+   other pool into POOL, preferring a run of LEND_PAGES pages so
+   that we do not come back too often.  Returns true if any pages
+   were moved. */
 static bool
-page_from_pool (const struct pool *pool, void *page) 
+pool_borrow (struct pool *pool, size_t page_cnt)
 {
-  size_t page_no = pg_no (page);
-  size_t start_page = pg_no (pool->base);
-  size_t end_page = start_page + bitmap_size (pool->used_map);
+  struct pool *lender = pool == &user_pool ? &kernel_pool : &user_pool;
+  size_t cnt = page_cnt > LEND_PAGES ? page_cnt : LEND_PAGES;
+  size_t lender_free, page_idx = BITMAP_ERROR;
 
-  return page_no >= start_page && page_no < end_page;
+  lock_both_pools ();
+  lender_free = lender->owned_cnt - lender->used_cnt;
+  for (;;)
+    {
+      if (pool->owned_cnt + cnt <= pool->max_cnt
+          && lender_free >= lender->low_wmark + cnt)
+        page_idx = bitmap_scan_and_flip (lender->used_map, 0, cnt, false);
+      if (page_idx != BITMAP_ERROR || cnt == page_cnt)
+        break;
+      cnt = cnt / 2 > page_cnt ? cnt / 2 : page_cnt;
+    }
+
+  if (page_idx != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (pool->used_map, page_idx, cnt, false);
+      bitmap_set_multiple (owner_map, page_idx, cnt, pool == &user_pool);
+      lender->owned_cnt -= cnt;
+      lender->lent_cnt += cnt;
+      pool->owned_cnt += cnt;
+      pool->borrowed_cnt += cnt;
+    }
+  unlock_both_pools ();
+
+  return page_idx != BITMAP_ERROR;
+}
+
+/* Acquires both pool locks, always in the same order. */
+static void
+lock_both_pools (void)
+{
+  lock_acquire (&kernel_pool.lock);
+  lock_acquire (&user_pool.lock);
+}
+
+/* Releases the locks taken by lock_both_pools(). */
+static void
+unlock_both_pools (void)
+{
+  lock_release (&user_pool.lock);
+  lock_release (&kernel_pool.lock);
 }
@@ -16,5 +16,13 @@ void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+size_t palloc_free_cnt (enum palloc_flags);
+void palloc_print_stats (void);
+
+/* Pages handed out by either pool are numbered densely from 0 to
+   palloc_page_cnt() - 1. */
+size_t palloc_page_cnt (void);
+size_t palloc_page_no (const void *page);
+void *palloc_page_addr (size_t page_no);
 
 #endif /* threads/palloc.h */
@@ -66,6 +66,9 @@ static inline uintptr_t pd_no (const void *va) {
 #define PTE_U 0x4               /* 1=user/kernel, 0=kernel only. */
 #define PTE_A 0x20              /* 1=accessed, 0=not acccessed. */
 #define PTE_D 0x40              /* 1=dirty, 0=not dirty (PTEs only). */
+#define PTE_PS 0x80             /* 1=4 MB page (PDEs only). */
+#define PTE_G 0x100             /* 1=global, kept in the TLB across
+                                   CR3 loads if CR4.PGE is set. */
 
 static inline void pte_clear_access(uint32_t *pte) {
   *pte = (*pte) & (~PTE_A);
@@ -102,9 +105,11 @@ static inline uint32_t pde_create (uint32_t *pt) {
 }
 
 /* Returns a pointer to the page table that page directory entry
-   PDE, which must "present", points to. */
+   PDE, which must "present", points to.  PDE must not map a 4 MB
+   page, as the kernel's direct map may. */
 static inline uint32_t *pde_get_pt (uint32_t pde) {
   ASSERT (pde & PTE_P);
+  ASSERT ((pde & PTE_PS) == 0);
   return ptov (pde & PTE_ADDR);
 }
 
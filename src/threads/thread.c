@@ -129,7 +129,12 @@ thread_tick (void)
     idle_ticks++;
 #ifdef USERPROG
   else if (t->pagedir != NULL)
-    user_ticks++;
+    {
+      user_ticks++;
+#ifdef VM
+      t->run_ticks++;
+#endif
+    }
 #endif
   else
     kernel_ticks++;
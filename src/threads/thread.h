@@ -111,8 +111,24 @@ struct thread
 #endif
 
 #ifdef VM
-   struct hash mem_map;
+   struct hash mem_map;         // file mappings by id
    int32_t next_mmap_id;
+   struct vm_area **areas;      // sorted by address, see vm/vm_area.c
+   size_t area_cnt;
+   size_t area_cap;
+   void *stack_bottom;  // lowest page reserved for the stack
+   void *heap_start;    // first page of the heap, past the data segments
+   void *brk;           // end of the heap, moved by sbrk()
+   void *user_esp;      // esp at the last system call, for faults in the kernel
+   struct fault_stats *fault_stats; // page faults of this process, see vm/fault.c
+   uint64_t fault_start; // TSC at the start of the fault being handled, or 0
+   int fault_kind;
+   size_t fault_io;     // bytes of I/O caused by the fault being handled
+   size_t rss;          // frames mapped, see vm/frame.c
+   struct list rss_list; // their PTEs, by struct rmap rss_elem
+   size_t ws_target;    // frames it may keep while others need them
+   int64_t run_ticks;   // timer ticks spent running, the fault clock
+   int64_t last_fault;  // run_ticks at the last fault that loaded a page
 #endif
 
     /* Owned by thread.c. */
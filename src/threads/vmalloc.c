@@ -0,0 +1,185 @@
+#include "threads/vmalloc.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <round.h>
+#include <string.h>
+#include "threads/init.h"
+#include "threads/palloc.h"
+#include "threads/pte.h"
+#include "threads/synch.h"
+
+/* Virtually contiguous kernel allocator.
+
+   palloc_get_multiple() hands out physically contiguous runs of
+   pages, which become hard to find once the kernel pool is
+   fragmented.  vmalloc() instead takes single pages from the
+   kernel pool, wherever they are, and maps them side by side in
+   a range of kernel virtual memory reserved for that purpose,
+   VMALLOC_START...VMALLOC_END.
+
+   The page tables covering the range are allocated once, at
+   boot, and hooked into init_page_dir before any process page
+   directory is created.  Every page directory copies the
+   kernel's PDEs from init_page_dir, so they all share these page
+   tables and see vmalloc() mappings without further work.
+
+   Memory returned by vmalloc() must not be passed to vtop(): it
+   is not part of the direct map of physical memory. */
+
+/* Number of page tables needed to cover the vmalloc range. */
+#define VMALLOC_PT_CNT DIV_ROUND_UP (VMALLOC_PAGES, PGSIZE / sizeof (uint32_t))
+
+/* Page tables that map the vmalloc range. */
+static uint32_t *vmalloc_pts[VMALLOC_PT_CNT];
+
+/* Bitmap of in-use virtual pages, and bitmap that marks the last
+   page of each allocation so that vfree() knows where to stop. */
+static struct bitmap *used_map;
+static struct bitmap *end_map;
+static uint8_t used_buf[VMALLOC_PAGES / 8 + 16];
+static uint8_t end_buf[VMALLOC_PAGES / 8 + 16];
+
+static struct lock vmalloc_lock;
+
+static uint32_t *page_to_pte (const void *);
+static void unmap_pages (uint8_t *, size_t page_cnt);
+
+/* Reserves the vmalloc virtual range in init_page_dir.  Must be
+   called after paging_init() and before any page directory is
+   created from init_page_dir. */
+void
+vmalloc_init (void)
+{
+  size_t i;
+
+  ASSERT (init_page_dir != NULL);
+  ASSERT ((uint8_t *) ptov (init_ram_pages * PGSIZE)
+          <= (uint8_t *) VMALLOC_START);
+  ASSERT (pg_ofs (VMALLOC_START) == 0 && pt_no (VMALLOC_START) == 0);
+
+  for (i = 0; i < VMALLOC_PT_CNT; i++)
+    {
+      size_t pde_idx = pd_no (VMALLOC_START) + i;
+
+      ASSERT (init_page_dir[pde_idx] == 0);
+      vmalloc_pts[i] = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+      init_page_dir[pde_idx] = pde_create (vmalloc_pts[i]);
+    }
+
+  used_map = bitmap_create_in_buf (VMALLOC_PAGES, used_buf, sizeof used_buf);
+  end_map = bitmap_create_in_buf (VMALLOC_PAGES, end_buf, sizeof end_buf);
+  lock_init (&vmalloc_lock);
+}
+
+/* Allocates SIZE bytes of virtually contiguous kernel memory
+   backed by kernel pool pages that need not be physically
+   contiguous.  Returns a page-aligned pointer, or a null pointer
+   if the virtual range or the kernel pool is exhausted. */
+void *
+vmalloc (size_t size)
+{
+  size_t page_cnt = DIV_ROUND_UP (size, PGSIZE);
+  size_t page_idx, i;
+  uint8_t *vaddr;
+
+  if (page_cnt == 0)
+    return NULL;
+
+  lock_acquire (&vmalloc_lock);
+  page_idx = bitmap_scan_and_flip (used_map, 0, page_cnt, false);
+  lock_release (&vmalloc_lock);
+  if (page_idx == BITMAP_ERROR)
+    return NULL;
+
+  vaddr = (uint8_t *) VMALLOC_START + page_idx * PGSIZE;
+  for (i = 0; i < page_cnt; i++)
+    {
+      void *kpage = palloc_get_page (0);
+      if (kpage == NULL)
+        {
+          unmap_pages (vaddr, i);
+          lock_acquire (&vmalloc_lock);
+          bitmap_set_multiple (used_map, page_idx, page_cnt, false);
+          lock_release (&vmalloc_lock);
+          return NULL;
+        }
+
+      /* The PTE was clear, so no stale TLB entry can exist. */
+      *page_to_pte (vaddr + i * PGSIZE) = pte_create_kernel (kpage, true)
+                                          | init_pte_global;
+    }
+
+  lock_acquire (&vmalloc_lock);
+  bitmap_mark (end_map, page_idx + page_cnt - 1);
+  lock_release (&vmalloc_lock);
+  return vaddr;
+}
+
+/* Frees memory P, which must have been returned by vmalloc(). */
+void
+vfree (void *p)
+{
+  size_t page_idx, end_idx;
+
+  if (p == NULL)
+    return;
+
+  ASSERT (is_vmalloc_vaddr (p));
+  ASSERT (pg_ofs (p) == 0);
+
+  page_idx = pg_no (p) - pg_no (VMALLOC_START);
+
+  lock_acquire (&vmalloc_lock);
+  ASSERT (bitmap_test (used_map, page_idx));
+  end_idx = bitmap_scan (end_map, page_idx, 1, true);
+  ASSERT (end_idx != BITMAP_ERROR);
+  bitmap_reset (end_map, end_idx);
+  lock_release (&vmalloc_lock);
+
+  unmap_pages (p, end_idx - page_idx + 1);
+
+  lock_acquire (&vmalloc_lock);
+  bitmap_set_multiple (used_map, page_idx, end_idx - page_idx + 1, false);
+  lock_release (&vmalloc_lock);
+}
+
+/* Returns true if VADDR lies in the vmalloc range. */
+bool
+is_vmalloc_vaddr (const void *vaddr)
+{
+  return (const uint8_t *) vaddr >= (const uint8_t *) VMALLOC_START
+         && (const uint8_t *) vaddr < (const uint8_t *) VMALLOC_END;
+}
+
+/* Returns the PTE that maps page VADDR of the vmalloc range. */
+static uint32_t *
+page_to_pte (const void *vaddr)
+{
+  size_t page_idx = pg_no (vaddr) - pg_no (VMALLOC_START);
+  size_t ptes_per_pt = PGSIZE / sizeof (uint32_t);
+
+  return &vmalloc_pts[page_idx / ptes_per_pt][page_idx % ptes_per_pt];
+}
+
+/* Unmaps PAGE_CNT pages starting at VADDR and returns their
+   frames to the kernel pool. */
+static void
+unmap_pages (uint8_t *vaddr, size_t page_cnt)
+{
+  size_t i;
+
+  for (i = 0; i < page_cnt; i++)
+    {
+      uint8_t *page = vaddr + i * PGSIZE;
+      uint32_t *pte = page_to_pte (page);
+
+      ASSERT (*pte & PTE_P);
+      palloc_free_page (pte_get_page (*pte));
+      *pte = 0;
+
+      /* Drop the stale TLB entry without flushing the rest of
+         the TLB, as reloading CR3 would.  Unlike a CR3 load,
+         invlpg also drops global entries. */
+      asm volatile ("invlpg (%0)" : : "r" (page) : "memory");
+    }
+}
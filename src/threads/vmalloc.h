@@ -0,0 +1,22 @@
+#ifndef THREADS_VMALLOC_H
+#define THREADS_VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "threads/vaddr.h"
+
+/* Kernel virtual address range reserved for vmalloc().  It sits
+   well above the direct map of physical memory, which ends at
+   PHYS_BASE + 64 MB at most. */
+#define VMALLOC_START ((void *) 0xf0000000)
+#define VMALLOC_PAGES 4096                      /* 16 MB. */
+#define VMALLOC_END ((void *) ((uint8_t *) VMALLOC_START \
+                               + VMALLOC_PAGES * PGSIZE))
+
+void vmalloc_init (void);
+void *vmalloc (size_t size);
+void vfree (void *);
+bool is_vmalloc_vaddr (const void *);
+
+#endif /* threads/vmalloc.h */
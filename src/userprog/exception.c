@@ -6,6 +6,8 @@
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 #include "vm/vm_area.h"
+#include "vm/fault.h"
+#include "vm/frame.h"
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -66,7 +68,8 @@ exception_init (void)
 void
 exception_print_stats (void) 
 {
-  printf ("Exception: %lld page faults\n", page_fault_cnt);
+  printf ("Exception: %lld page faults, %llu served by the zero page\n",
+          page_fault_cnt, vm_area_zero_page_cnt ());
 }
 
 /* Handler for an exception (probably) caused by a user process. */
@@ -142,8 +145,9 @@ page_fault (struct intr_frame *f)
      be assured of reading CR2 before it changed). */
   intr_enable ();
 
-  /* Count page faults. */
+  /* Count page faults, and time the ones we handle. */
   page_fault_cnt++;
+  bool timed = fault_begin ();
 
   /* Determine cause. */
   not_present = (f->error_code & PF_P) == 0;
@@ -156,8 +160,19 @@ page_fault (struct intr_frame *f)
   
   if (not_present) {
      // try to load
-     if (vm_area_load(paddr))
-      return;
+     if (vm_area_load(paddr, write))
+      goto done;
+     // or grow the stack; esp is only saved by the CPU for user faults
+     if (vm_area_grow_stack(fault_addr,
+                            user ? f->esp : thread_current ()->user_esp))
+      goto done;
+  }
+  else if (write) {
+     // a page shared copy-on-write since a fork
+     if (vm_area_cow(paddr)) {
+      fault_classify (FAULT_COW);
+      goto done;
+     }
   }
   /* To implement virtual memory, delete the rest of the function
      body, and replace it with code that brings in the page to
@@ -169,6 +184,16 @@ page_fault (struct intr_frame *f)
 //           user ? "user" : "kernel");
 
 fail:
+  fault_classify (FAULT_INVALID);
+  if (timed)
+    fault_end ();
   kill (f);
+  return;
+
+done:
+  /* Once per page brought in, for the page-fault frequency. */
+  frame_table_fault ();
+  if (timed)
+    fault_end ();
 }
 
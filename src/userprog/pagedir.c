@@ -1,16 +1,24 @@
 #include "userprog/pagedir.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #ifdef VM
 #include "vm/frame.h"
+#include "vm/vm_area.h"
 #endif
 
 static uint32_t *active_pd (void);
 static void invalidate_pagedir (uint32_t *);
+static void invalidate_page (uint32_t *, const void *);
+
+/* TLB invalidations: pages flushed one by one with invlpg, and
+   reloads of CR3 that flush the whole TLB. */
+static unsigned long long invlpg_cnt;
+static unsigned long long reload_cnt;
 
 /* Creates a new page directory that has mappings for kernel
    virtual addresses, but none for user virtual addresses.
@@ -43,18 +51,48 @@ pagedir_destroy (uint32_t *pd)
         uint32_t *pte;
         
         for (pte = pt; pte < pt + PGSIZE / sizeof *pte; pte++) {
-          if (*pte & PTE_P) {
-            void *kpage = pte_get_page(*pte);
 #ifdef VM
-            frame_table_remove(kpage, pte);
+          /* Frees the frame or swap block behind the PTE, if any. */
+          if (*pte != 0)
+            vm_area_destroy_pte (pte);
 #endif
-          }
         }
        palloc_free_page (pt);
       }
   palloc_free_page (pd);
 }
 
+#ifdef VM
+/* Makes DST, a page directory without user mappings, map the same
+   user pages as SRC, which belongs to another process: frames are
+   shared copy-on-write, swap blocks by reference.  Returns false if
+   memory allocation fails, in which case DST holds the pages copied
+   so far and must still be destroyed. */
+bool
+pagedir_copy (uint32_t *dst, uint32_t *src)
+{
+  uint32_t *pde;
+
+  for (pde = src; pde < src + pd_no (PHYS_BASE); pde++)
+    if (*pde & PTE_P)
+      {
+        uint32_t *pt = pde_get_pt (*pde);
+        size_t i;
+
+        for (i = 0; i < PGSIZE / sizeof *pt; i++)
+          if (pt[i] != 0)
+            {
+              void *upage = (void *) (((pde - src) << PDSHIFT)
+                                      | (i << PTSHIFT));
+              uint32_t *pte = pagedir_get_pte (dst, upage, true);
+              if (pte == NULL || !vm_area_fork_pte (pte, &pt[i]))
+                return false;
+            }
+      }
+  return true;
+}
+#endif
+
 /* Returns the address of the page table entry for virtual
    address VADDR in page directory PD.
    If PD does not have a page table for VADDR, behavior depends
@@ -118,11 +156,14 @@ pagedir_set_page (uint32_t *pd, void *upage, void *kpage, bool writable)
 
   if (pte != NULL) 
     {
+      uint32_t origin = *pte;
+
       ASSERT ((*pte & PTE_P) == 0);
       *pte = pte_create_user (kpage, writable);
 #ifdef VM
-      // insert this mapping into the frame table
-      frame_table_insert(kpage, pte);
+      // insert this mapping into the frame table, remembering the
+      // not-present PTE it replaces
+      frame_table_insert(kpage, pte, upage, origin);
 #endif
       return true;
     }
@@ -164,9 +205,13 @@ pagedir_clear_page (uint32_t *pd, void *upage)
   if (pte != NULL && (*pte & PTE_P) != 0)
     {
       void *kpage = pte_get_page(*pte);
-      frame_table_remove(kpage, pte);
+#ifdef VM
+      /* Nothing to do if the frame was evicted meanwhile. */
+      if (!frame_table_remove(kpage, pte))
+        return;
+#endif
       *pte &= ~PTE_P;
-      invalidate_pagedir (pd);
+      invalidate_page (pd, upage);
     }
 }
 
@@ -194,7 +239,7 @@ pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty)
       else 
         {
           *pte &= ~(uint32_t) PTE_D;
-          invalidate_pagedir (pd);
+          invalidate_page (pd, vpage);
         }
     }
 }
@@ -223,7 +268,7 @@ pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed)
       else 
         {
           *pte &= ~(uint32_t) PTE_A; 
-          invalidate_pagedir (pd);
+          invalidate_page (pd, vpage);
         }
     }
 }
@@ -244,6 +289,85 @@ pagedir_activate (uint32_t *pd)
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (pd)) : "memory");
 }
 
+/* Flushes the TLB by reloading the active page directory, for
+   code that changes PTEs without knowing which page directory
+   they belong to. */
+void
+pagedir_flush_tlb (void)
+{
+  reload_cnt++;
+  pagedir_activate (active_pd ());
+}
+
+/* Invalidates the TLB entries of the SIZE bytes of user pages
+   starting at UPAGE in PD, if PD is the active page directory:
+   page by page if there are at most PAGEDIR_BATCH_MAX of them,
+   otherwise by reloading the whole TLB. */
+void
+pagedir_flush_range (uint32_t *pd, const void *upage, size_t size)
+{
+  const uint8_t *p = pg_round_down (upage);
+  const uint8_t *end = (const uint8_t *) upage + size;
+
+  if (active_pd () != pd)
+    return;
+  if ((size_t) (end - p) > PAGEDIR_BATCH_MAX * PGSIZE)
+    invalidate_pagedir (pd);
+  else
+    for (; p < end; p += PGSIZE)
+      invalidate_page (pd, p);
+}
+
+/* Starts an empty batch of TLB invalidations. */
+void
+pagedir_batch_init (struct pagedir_batch *b)
+{
+  b->cnt = 0;
+}
+
+/* Adds UPAGE, whose PTE is PTE, to batch B.  Only a PTE of the
+   active page directory can be in the TLB, so the others are left
+   out: the CPU drops their entries when it switches page
+   directories. */
+void
+pagedir_batch_add (struct pagedir_batch *b, const uint32_t *pte,
+                   const void *upage)
+{
+  uint32_t *pde = active_pd () + pd_no (upage);
+
+  if ((*pde & PTE_P) == 0 || pde_get_pt (*pde) + pt_no (upage) != pte)
+    return;
+  if (b->cnt < PAGEDIR_BATCH_MAX)
+    b->pages[b->cnt] = upage;
+  b->cnt++;
+}
+
+/* Invalidates the TLB entries of the pages in batch B, or the
+   whole TLB if there were too many of them, and empties B. */
+void
+pagedir_batch_flush (struct pagedir_batch *b)
+{
+  size_t i;
+
+  if (b->cnt > PAGEDIR_BATCH_MAX)
+    pagedir_flush_tlb ();
+  else
+    for (i = 0; i < b->cnt; i++)
+      {
+        invlpg_cnt++;
+        asm volatile ("invlpg (%0)" : : "r" (b->pages[i]) : "memory");
+      }
+  b->cnt = 0;
+}
+
+/* Prints TLB invalidation statistics. */
+void
+pagedir_print_stats (void)
+{
+  printf ("TLB: %llu pages invalidated, %llu full flushes\n",
+          invlpg_cnt, reload_cnt);
+}
+
 /* Returns the currently active page directory. */
 static uint32_t *
 active_pd (void) 
@@ -272,6 +396,20 @@ invalidate_pagedir (uint32_t *pd)
     {
       /* Re-activating PD clears the TLB.  See [IA32-v3a] 3.12
          "Translation Lookaside Buffers (TLBs)". */
+      reload_cnt++;
       pagedir_activate (pd);
     } 
 }
+
+/* Invalidates the TLB entry of user page UPAGE if PD is the active
+   page directory, leaving the rest of the TLB alone.  See
+   [IA32-v2a] "INVLPG--Invalidate TLB Entry". */
+static void
+invalidate_page (uint32_t *pd, const void *upage)
+{
+  if (active_pd () == pd)
+    {
+      invlpg_cnt++;
+      asm volatile ("invlpg (%0)" : : "r" (upage) : "memory");
+    }
+}
@@ -2,10 +2,14 @@
 #define USERPROG_PAGEDIR_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t *pagedir_create (void);
 void pagedir_destroy (uint32_t *pd);
+#ifdef VM
+bool pagedir_copy (uint32_t *dst, uint32_t *src);
+#endif
 uint32_t *pagedir_get_pte (uint32_t *pd, const void *vaddr, bool create);
 bool pagedir_set_page (uint32_t *pd, void *upage, void *kpage, bool rw);
 void *pagedir_get_page (uint32_t *pd, const void *upage);
@@ -15,5 +19,24 @@ void pagedir_set_dirty (uint32_t *pd, const void *upage, bool dirty);
 bool pagedir_is_accessed (uint32_t *pd, const void *upage);
 void pagedir_set_accessed (uint32_t *pd, const void *upage, bool accessed);
 void pagedir_activate (uint32_t *pd);
+void pagedir_flush_tlb (void);
+void pagedir_flush_range (uint32_t *pd, const void *upage, size_t size);
+
+/* A batch of TLB invalidations for PTEs changed together, flushed
+   with one invlpg per page or, beyond PAGEDIR_BATCH_MAX pages, with
+   a full TLB flush. */
+#define PAGEDIR_BATCH_MAX 32
+struct pagedir_batch
+  {
+    size_t cnt;                            /* Pages added, may exceed MAX. */
+    const void *pages[PAGEDIR_BATCH_MAX];  /* The first MAX of them. */
+  };
+
+void pagedir_batch_init (struct pagedir_batch *);
+void pagedir_batch_add (struct pagedir_batch *, const uint32_t *pte,
+                        const void *upage);
+void pagedir_batch_flush (struct pagedir_batch *);
+
+void pagedir_print_stats (void);
 
 #endif /* userprog/pagedir.h */
@@ -20,6 +20,8 @@
 #include "threads/synch.h"
 #include "threads/malloc.h"
 #include "vm/vm_area.h"
+#include "vm/frame.h"
+#include "vm/fault.h"
 
 
 // file descriptor
@@ -88,6 +90,7 @@ close_all_files(void) {
 }
 
 static thread_func start_process NO_RETURN;
+static thread_func start_fork NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
 
 static void set_parent(struct thread *t, tid_t parent) {
@@ -155,6 +158,97 @@ process_execute (const char *cmd_line)
   return tid;
 }
 
+// what the child of a fork starts from
+struct fork_args {
+  struct intr_frame if_;   // the parent's registers at the system call
+  struct thread *parent;   // blocked until the child is set up
+};
+
+/* Starts a new process that is a copy of the current one, resuming
+   from the system call frame F with 0 as the return value.  The
+   child shares the parent's frames copy-on-write and gets its own
+   file descriptors, with the same numbers and positions.  Returns
+   the new process's thread id, or TID_ERROR if the thread cannot be
+   created; as with process_execute(), the caller learns whether the
+   copy succeeded from process_wait_for_loading(). */
+tid_t
+process_fork (const struct intr_frame *f)
+{
+  struct fork_args *args;
+  tid_t tid;
+
+  args = malloc (sizeof *args);
+  if (args == NULL)
+    return TID_ERROR;
+  args->if_ = *f;
+  args->parent = thread_current ();
+
+  tid = thread_create (thread_name (), PRI_DEFAULT, start_fork, args);
+  if (tid == TID_ERROR)
+    free (args);
+  else
+    set_parent(thread_get(tid), thread_tid());
+  return tid;
+}
+
+// duplicate the file descriptors of parent
+static bool
+fork_files(struct thread *parent) {
+  struct thread *cur = thread_current();
+  struct list_elem *e;
+
+  for (e = list_begin(&parent->fds); e != list_end(&parent->fds); e = list_next(e)) {
+    struct file_dp *dp = list_entry(e, struct file_dp, elem);
+    struct file_dp *copy = malloc(sizeof(struct file_dp));
+    if (copy == NULL) return false;
+
+    copy->f = file_dup(dp->f);
+    if (copy->f == NULL) {
+      free(copy);
+      return false;
+    }
+    copy->fd = dp->fd;
+    list_push_back(&cur->fds, &copy->elem);
+  }
+  cur->next_fd = parent->next_fd;
+  return true;
+}
+
+/* A thread function that copies the process of the parent, which
+   waits in process_wait_for_loading(), and starts it running. */
+static void
+start_fork (void *args_)
+{
+  struct fork_args *args = args_;
+  struct thread *cur = thread_current();
+  struct intr_frame if_ = args->if_;
+  struct thread *parent = args->parent;
+  bool success;
+
+  free(args);
+  vm_area_init(cur);
+  cur->stack_bottom = parent->stack_bottom;
+  cur->heap_start = parent->heap_start;
+  cur->brk = parent->brk;
+
+  cur->pagedir = pagedir_create ();
+  if (cur->pagedir != NULL)
+    process_activate ();
+  success = cur->pagedir != NULL && fork_files(parent) && vm_area_fork(parent);
+
+  // copied
+  cur->success_load = success;
+  sema_up(&cur->load);
+
+  if (!success)
+    thread_exit ();
+
+  // the child sees fork() return 0
+  if_.eax = 0;
+  asm volatile ("movl %0, %%esp; jmp intr_exit" : : "g" (&if_) : "memory");
+  NOT_REACHED ();
+}
+
 static void 
 push_argument(void **esp, char **args) {
   int i;
@@ -281,6 +375,7 @@ process_exit (void)
   uint32_t *pd;
 
   close_all_files();
+  fault_process_exit(cur);
   vm_area_free(cur);
 
   /* Destroy the current process's page directory and switch back
@@ -404,6 +499,7 @@ load (const char *file_name, void (**eip) (void), void **esp)
   struct file *file = NULL;
   off_t file_ofs;
   bool success = false;
+  uint8_t *heap = NULL;
   int i;
 
   /* Allocate and activate page directory. */
@@ -492,6 +588,8 @@ load (const char *file_name, void (**eip) (void), void **esp)
               if (!load_segment (fd, file_page, (void *) mem_page,
                                  read_bytes, zero_bytes, writable))
                 goto done;
+              if ((uint8_t *) mem_page + read_bytes + zero_bytes > heap)
+                heap = (uint8_t *) mem_page + read_bytes + zero_bytes;
             }
           else
             goto done;
@@ -499,6 +597,9 @@ load (const char *file_name, void (**eip) (void), void **esp)
         }
     }
 
+  /* The heap starts out empty, right after the data segments. */
+  vm_area_set_heap (heap);
+
   /* Set up stack. */
   if (!setup_stack (esp))
     goto done;
@@ -589,8 +690,8 @@ load_segment (int fd, off_t ofs, uint8_t *upage,
 
   if (read_bytes > 0) {
     int mapid;
-    if ((mapid = vm_area_map(upage, fd, ofs, read_bytes, writable)) < 0) return false;
-    if (zero_bytes > PGSIZE) {
+    if ((mapid = vm_area_map(upage, fd, ofs, read_bytes, writable, false)) < 0) return false;
+    if (ROUND_DOWN(zero_bytes, PGSIZE) > 0) {
       if (!vm_area_zero(upage+ROUND_UP(read_bytes, PGSIZE), ROUND_DOWN(zero_bytes, PGSIZE), writable)) {
         vm_area_unmap(mapid);
         return false;
@@ -631,12 +732,21 @@ setup_stack (void **esp)
   uint8_t *kpage;
   bool success = false;
 
-  kpage = palloc_get_page (PAL_USER | PAL_ZERO);
+  /* The stack area, which faults below it stretch down. */
+  if (!vm_area_zero (((uint8_t *) PHYS_BASE) - PGSIZE, PGSIZE, true))
+    return false;
+
+  kpage = frame_table_alloc ();
   if (kpage != NULL) 
     {
+      memset (kpage, 0, PGSIZE);
       success = install_page (((uint8_t *) PHYS_BASE) - PGSIZE, kpage, true);
       if (success)
-        *esp = PHYS_BASE;
+        {
+          *esp = PHYS_BASE;
+          /* Faults below it grow the stack. */
+          thread_current ()->stack_bottom = ((uint8_t *) PHYS_BASE) - PGSIZE;
+        }
       else
         palloc_free_page (kpage);
     }
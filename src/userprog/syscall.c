@@ -13,9 +13,17 @@
 #include "devices/input.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
+#ifdef VM
+#include "vm/vm_area.h"
+#endif
 
 static void syscall_handler (struct intr_frame *);
 
+/* File reads and writes pin at most this many bytes of the user
+   buffer at a time, so that a large buffer cannot pin all of
+   memory. */
+#define PIN_CHUNK (64 * 1024)
+
 void
 syscall_init (void) 
 {
@@ -27,14 +35,65 @@ check_user_addr_area(const void *uaddr, size_t offset) {
   struct thread *cur = thread_current();
   const uint8_t *addr = pg_round_down(uaddr);
   while (addr < (uint8_t*)uaddr + offset) {
-    if (!is_user_vaddr(addr) ||
-        pagedir_get_page(cur->pagedir, addr) == NULL) {
+    if (!is_user_vaddr(addr)) {
       thread_exit();
     }
+    if (pagedir_get_page(cur->pagedir, addr) == NULL) {
+#ifdef VM
+      // bring in pages that are lazily loaded or swapped out, or
+      // below the stack
+      if (!vm_area_load((void *) addr, false) &&
+          !vm_area_grow_stack((void *) addr, cur->user_esp))
+#endif
+        thread_exit();
+    }
     addr = addr + PGSIZE;
   }
 }
 
+/* Like check_user_addr_area, for a buffer the kernel is about to
+   write to: pages shared copy-on-write since a fork get their
+   private copies now instead of in a page fault in the middle of a
+   file system operation. */
+static void
+check_user_buffer_writable(void *uaddr, size_t size) {
+  check_user_addr_area(uaddr, size);
+#ifdef VM
+  struct thread *cur = thread_current();
+  uint8_t *addr = pg_round_down(uaddr);
+  for (; addr < (uint8_t*)uaddr + size; addr += PGSIZE) {
+    uint32_t *pte = pagedir_get_pte(cur->pagedir, addr, false);
+    if (pte != NULL && (*pte & PTE_COW) && !vm_area_cow(addr))
+      thread_exit();
+  }
+#endif
+}
+
+/* Brings in the pages of the user buffer at UADDR and keeps them in
+   memory until unpin_user_buffer(), so that a file system call that
+   uses it takes no page faults while it holds its locks.  WRITE
+   readies them for writes by the kernel.  Kills the process if the
+   buffer is not valid user memory. */
+static void
+pin_user_buffer(const void *uaddr, size_t size, bool write) {
+#ifdef VM
+  if (!vm_area_pin(uaddr, size, write))
+    thread_exit();
+#else
+  if (write)
+    check_user_buffer_writable((void *) uaddr, size);
+  else
+    check_user_addr_area(uaddr, size);
+#endif
+}
+
+static void
+unpin_user_buffer(const void *uaddr UNUSED, size_t size UNUSED) {
+#ifdef VM
+  vm_area_unpin(uaddr, size);
+#endif
+}
+
 static void check_user_addr_str(const char *str) {
   const char *addr = pg_round_down(str)-PGSIZE;
 
@@ -83,6 +142,19 @@ sys_exec(const char* cmd_line) {
   return (int) tid;
 }
 
+static int
+sys_fork(struct intr_frame *f) {
+  tid_t tid = process_fork(f);
+  if (tid == TID_ERROR) return -1;
+
+  // wait for the copy of the address space
+  if (!process_wait_for_loading(tid)) {
+    ASSERT(process_wait(tid) == -1);
+    return -1;
+  }
+  return (int) tid;
+}
+
 static int
 sys_wait(tid_t tid) { // map pid to the same tid
   return process_wait(tid);
@@ -155,19 +227,31 @@ sys_read_from_stdin(uint8_t *buffer, unsigned size) {
 static int
 sys_read(int fd, void *buffer, unsigned size) {
   struct file *f;
-
-  check_user_addr_area(buffer, size);
+  unsigned done = 0;
 
   // stdin
   if (fd == STDIN_FILENO) {
+    check_user_buffer_writable(buffer, size);
     return sys_read_from_stdin(buffer, size);
   }
 
   if ((f = process_fd_get(fd)) == NULL) {
+    check_user_addr_area(buffer, size);
     return -1;
   }
 
-  return file_read(f, buffer, size);
+  while (done < size) {
+    unsigned chunk = size - done < PIN_CHUNK ? size - done : PIN_CHUNK;
+    off_t read;
+
+    pin_user_buffer((uint8_t *) buffer + done, chunk, true);
+    read = file_read(f, (uint8_t *) buffer + done, chunk);
+    unpin_user_buffer((uint8_t *) buffer + done, chunk);
+    done += read;
+    if ((unsigned) read < chunk)
+      break;
+  }
+  return done;
 }
 
 static int
@@ -178,20 +262,31 @@ write_to_stdout(const void* buffer, unsigned size) {
 
 static int
 sys_write(int fd, const void *buffer, unsigned size) {
-  struct file *f;
-  // check buffer
-  check_user_addr_area(buffer, size);
+  struct file *f = NULL;
+  unsigned done = 0;
 
   // printf("write fd: %d, buffer: %p, size: %u\n", fd, buffer, size);
-  if (fd == STDOUT_FILENO) {
-    return write_to_stdout(buffer, size);
-  }
-
-  if ((f = process_fd_get(fd)) == NULL) {
+  if (fd != STDOUT_FILENO && (f = process_fd_get(fd)) == NULL) {
+    check_user_addr_area(buffer, size);
     return -1;
   }
 
-  return file_write(f, buffer, size);
+  while (done < size) {
+    unsigned chunk = size - done < PIN_CHUNK ? size - done : PIN_CHUNK;
+    const uint8_t *p = (const uint8_t *) buffer + done;
+    off_t written;
+
+    pin_user_buffer(p, chunk, false);
+    if (f == NULL)
+      written = write_to_stdout(p, chunk);
+    else
+      written = file_write(f, p, chunk);
+    unpin_user_buffer(p, chunk);
+    done += written;
+    if ((unsigned) written < chunk)
+      break;
+  }
+  return done;
 }
 
 static void
@@ -214,10 +309,51 @@ sys_tell(int fd) {
   return file_tell(f);
 }
 
+#ifdef VM
+/* Maps the whole file of FD at ADDR, shared: dirty pages go back to
+   the file on munmap or exit. */
+static int
+sys_mmap(int fd, void *addr) {
+  struct file *f;
+  off_t size;
+
+  if ((f = process_fd_get(fd)) == NULL) {
+    return -1;
+  }
+  size = file_length(f);
+  if (size == 0 || addr == NULL || pg_ofs(addr) != 0 ||
+      !is_user_vaddr(addr) ||
+      (size_t) size > (size_t) ((uint8_t*)PHYS_BASE - (uint8_t*)addr)) {
+    return -1;
+  }
+
+  return vm_area_map(addr, fd, 0, size, true, true);
+}
+
+static void
+sys_munmap(int mapid) {
+  vm_area_unmap(mapid);
+}
+
+static void *
+sys_sbrk(intptr_t increment) {
+  return vm_area_sbrk(increment);
+}
+
+static int
+sys_madvise(void *addr, size_t length, int advice) {
+  return vm_area_advise(addr, length, advice) ? 0 : -1;
+}
+#endif
+
 
 static void
 syscall_handler (struct intr_frame *f UNUSED) 
 {
+#ifdef VM
+  // faults on user memory in the kernel grow the stack relative to it
+  thread_current()->user_esp = f->esp;
+#endif
   switch (get_syscall_num(f))
   {
     case SYS_HALT:
@@ -266,6 +402,26 @@ syscall_handler (struct intr_frame *f UNUSED)
     case SYS_CLOSE:
       sys_close(get_syscall_arg(f, 0));
       break;
+    case SYS_FORK:
+      f->eax = sys_fork(f);
+      break;
+#ifdef VM
+    case SYS_MMAP:
+      f->eax = sys_mmap((int)get_syscall_arg(f, 0),
+                        (void*)get_syscall_arg(f, 1));
+      break;
+    case SYS_MUNMAP:
+      sys_munmap((int)get_syscall_arg(f, 0));
+      break;
+    case SYS_SBRK:
+      f->eax = (uint32_t) sys_sbrk((intptr_t)get_syscall_arg(f, 0));
+      break;
+    case SYS_MADVISE:
+      f->eax = sys_madvise((void*)get_syscall_arg(f, 0),
+                           (size_t)get_syscall_arg(f, 1),
+                           (int)get_syscall_arg(f, 2));
+      break;
+#endif
     default:
       ASSERT(0);
   }
@@ -0,0 +1,170 @@
+#include "vm/fault.h"
+
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+
+// the first bucket of a histogram holds the faults that took fewer
+// than 2^FAULT_HIST_SHIFT cycles, each further bucket twice as many,
+// the last one everything above
+#define FAULT_HIST_SHIFT 10
+#define FAULT_HIST_BUCKETS 16
+
+struct fault_kind_stats
+{
+    unsigned long long cnt;
+    unsigned long long io_bytes;
+    unsigned long long cycles;
+    unsigned hist[FAULT_HIST_BUCKETS];
+};
+
+struct fault_stats
+{
+    struct fault_kind_stats kinds[FAULT_KIND_CNT];
+};
+
+static const char *kind_names[FAULT_KIND_CNT] = {
+    "zero-fill", "file", "swap-in", "copy-on-write", "stack growth", "invalid",
+};
+
+// the whole system
+static struct fault_stats global;
+
+static bool per_process;
+
+static inline uint64_t rdtsc(void)
+{
+    uint64_t t;
+    asm volatile("rdtsc" : "=A"(t));
+    return t;
+}
+
+void fault_set_per_process(bool enable)
+{
+    per_process = enable;
+}
+
+bool fault_begin(void)
+{
+    struct thread *cur = thread_current();
+
+    if (cur->fault_start != 0)
+        return false;
+    cur->fault_kind = FAULT_INVALID;
+    cur->fault_io = 0;
+    cur->fault_start = rdtsc();
+    return true;
+}
+
+void fault_classify(enum fault_kind kind)
+{
+    struct thread *cur = thread_current();
+
+    if (cur->fault_start != 0)
+        cur->fault_kind = kind;
+}
+
+void fault_add_io(size_t bytes)
+{
+    struct thread *cur = thread_current();
+
+    if (cur->fault_start != 0)
+        cur->fault_io += bytes;
+}
+
+static void record(struct fault_stats *s, enum fault_kind kind,
+                   uint64_t cycles, size_t io)
+{
+    struct fault_kind_stats *k = &s->kinds[kind];
+    size_t b = 0;
+
+    while (b < FAULT_HIST_BUCKETS - 1 && cycles >= (1ULL << (FAULT_HIST_SHIFT + b)))
+        b++;
+    k->cnt++;
+    k->io_bytes += io;
+    k->cycles += cycles;
+    k->hist[b]++;
+}
+
+void fault_end(void)
+{
+    struct thread *cur = thread_current();
+    uint64_t cycles = rdtsc() - cur->fault_start;
+    enum intr_level old_level;
+
+    ASSERT(cur->fault_start != 0);
+    old_level = intr_disable();
+    record(&global, cur->fault_kind, cycles, cur->fault_io);
+    intr_set_level(old_level);
+    if (cur->fault_stats != NULL)
+        record(cur->fault_stats, cur->fault_kind, cycles, cur->fault_io);
+    cur->fault_start = 0;
+}
+
+void fault_process_init(struct thread *t)
+{
+    t->fault_start = 0;
+    t->fault_stats = per_process ? calloc(1, sizeof *t->fault_stats) : NULL;
+}
+
+// print the histogram bounds of bucket b into buf
+static void bucket_name(char *buf, size_t size, size_t b)
+{
+    static const char *units[] = {"", "K", "M", "G"};
+    bool last = b == FAULT_HIST_BUCKETS - 1;
+    unsigned shift = FAULT_HIST_SHIFT + b - last;
+
+    snprintf(buf, size, "%s%u%s", last ? ">=" : "<", 1u << shift % 10,
+             units[shift / 10]);
+}
+
+static void print_stats(const char *who, const struct fault_stats *s)
+{
+    size_t kind, b;
+
+    for (kind = 0; kind < FAULT_KIND_CNT; kind++)
+    {
+        const struct fault_kind_stats *k = &s->kinds[kind];
+        char line[256], name[16];
+        int len;
+
+        if (k->cnt == 0)
+            continue;
+        len = snprintf(line, sizeof line,
+                       "%s: %llu %s faults, %llu kB I/O, %llu cycles avg:",
+                       who, k->cnt, kind_names[kind], k->io_bytes / 1024,
+                       k->cycles / k->cnt);
+        for (b = 0; b < FAULT_HIST_BUCKETS; b++)
+        {
+            if (k->hist[b] == 0 || len >= (int)sizeof line)
+                continue;
+            bucket_name(name, sizeof name, b);
+            len += snprintf(line + len, sizeof line - len, " %s:%u", name,
+                            k->hist[b]);
+        }
+        printf("%s\n", line);
+    }
+}
+
+void fault_process_exit(struct thread *t)
+{
+    char who[32];
+
+    if (t->fault_stats == NULL)
+        return;
+    if (per_process)
+    {
+        snprintf(who, sizeof who, "Fault %s (%d)", t->name, t->tid);
+        print_stats(who, t->fault_stats);
+    }
+    free(t->fault_stats);
+    t->fault_stats = NULL;
+}
+
+void fault_print_stats(void)
+{
+    print_stats("Fault", &global);
+}
@@ -0,0 +1,51 @@
+#ifndef VM_FAULT_H
+#define VM_FAULT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "threads/thread.h"
+
+// FAULT STATISTICS
+// page faults by kind, with latency histograms in TSC cycles and the
+// bytes of I/O they caused, for the whole system and for each process
+
+enum fault_kind
+{
+    FAULT_ZERO,    // zero-filled page, or the shared zero page
+    FAULT_FILE,    // page of a file mapping
+    FAULT_SWAP,    // page read back from swap
+    FAULT_COW,     // write to a page shared copy-on-write
+    FAULT_STACK,   // stack growth
+    FAULT_INVALID, // the process is killed
+    FAULT_KIND_CNT
+};
+
+// print the statistics of each process when it exits
+void fault_set_per_process(bool enable);
+
+// start timing a page fault of the current thread
+// return false, leaving the fault alone, if one is already timed
+bool fault_begin(void);
+
+// the fault of the current thread, if one is being timed, is of kind
+// the last call wins
+void fault_classify(enum fault_kind kind);
+
+// the fault of the current thread, if one is being timed, caused
+// bytes of I/O
+void fault_add_io(size_t bytes);
+
+// record the fault of the current thread started by fault_begin
+void fault_end(void);
+
+// start per-process statistics for t
+void fault_process_init(struct thread *t);
+
+// print the statistics of t if enabled and release them
+void fault_process_exit(struct thread *t);
+
+// print the statistics of the whole system
+void fault_print_stats(void);
+
+#endif /* vm/fault.h */
@@ -1,190 +1,1171 @@
 #include "vm/frame.h"
 
-#include <list.h>
-#include <hash.h>
 #include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "filesys/inode.h"
 
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
+#include "threads/thread.h"
+#include "userprog/pagedir.h"
 #include "vm/vm_area.h"
 #include "vm/swap.h"
 
-// kaddr -> list of frame_entry
-struct frame_entry
+// a PTE that refers to a frame
+struct rmap
 {
-    struct hash_elem elem;
-    void *addr; // the kernel address of the frame
-    struct list list;
+    uint32_t *pte;
+    void *upage;       // the user page pte maps, for TLB invalidation
+    uint32_t origin;   // the not-present PTE the page was loaded from
+    struct thread *owner; // the process of pte, whose resident set counts it
+    struct list_elem rss_elem; // in the rss_list of owner while it maps the frame
+    struct rmap *next; // further PTEs that refer to the same frame
 };
 
-// list of of PTEs of user pages that refers to the frame
-struct pte_elem
+// frame descriptor, indexed by palloc page number
+// the first PTE that refers to the frame is kept inline,
+// only shared frames need an overflow chain
+struct frame
 {
-    uint32_t *pte;
-    struct list_elem elem;
+    struct rmap map; // map.pte is null if the frame is not in the table
+    unsigned pin_cnt; // the clock passes the frame over while pinned
+
+    // PAGE CACHE
+    // a read-only file page that any process mapping the same bytes
+    // of the same file may share; inode is null if the frame is not
+    // in the page cache
+    struct inode *inode; // holds a reference while cached
+    off_t offset;
+    size_t length;       // bytes from the file, the rest is zero
+    struct hash_elem cache_elem;
 };
 
-static struct hash frame_table;
+static struct frame *frames;
+static size_t frame_cnt;
 static struct lock table_lock;
 
-/* Returns a hash value for frame p. */
-static unsigned frame_entry_hash(const struct hash_elem *p_, void *aux UNUSED)
+// ZERO PAGE
+// read faults on untouched zero-filled pages all map this kernel page
+// read-only, with PTE_COW if the page is writable, so that a frame of
+// its own is only allocated on the first write.  It is never in the
+// table: its PTEs are not tracked and it is never evicted.
+static void *zero_page;
+
+// frames in the page cache, by (inode, offset, length)
+static struct hash page_cache;
+
+// signaled whenever an eviction finishes
+static struct condition evict_done;
+
+// frames in use that the clock looks at before it settles for a
+// dirty victim
+#define CLOCK_SCAN_LIMIT 64
+
+// next frame the clock looks at
+static size_t clock_hand;
+
+// eviction statistics
+static struct
 {
-    struct frame_entry *p = hash_entry(p_, struct frame_entry, elem);
-    return hash_bytes(&p->addr, sizeof p->addr);
-}
+    unsigned long long evict_cnt;
+    unsigned long long clean_cnt; // victims that needed no write back
+    unsigned long long dirty_cnt;
+    unsigned long long scan_cnt;  // frames looked at by the clock
+    unsigned long long scan_max;  // longest scan for one eviction
+    unsigned long long swap_out_cnt;
+    unsigned long long swap_full_cnt;
+    unsigned long long direct_cnt;  // evictions by a faulting thread
+    unsigned long long reclaim_cnt; // frames freed by the reclaim thread
+    unsigned long long wakeup_cnt;
+    unsigned long long share_cnt;  // faults served from the page cache
+    size_t cached_cnt;             // frames in the page cache
+    size_t cached_max;
+    unsigned long long fork_cnt;      // frames shared by fork
+    unsigned long long cow_copy_cnt;  // copies made on write
+    unsigned long long cow_reuse_cnt; // writes that found no one to share with
+    unsigned long long zero_copy_cnt; // first writes to the zero page
+    unsigned long long pin_cnt;       // frames pinned for system calls
+    unsigned long long pin_skip_cnt;  // pinned frames passed over
+    unsigned long long pff_grow_cnt;    // faults that raised a target
+    unsigned long long pff_shrink_cnt;  // faults that set a target to the working set
+    unsigned long long ws_page_cnt;     // pages found in those working sets
+    unsigned long long pff_surplus_cnt; // victims above the target of a process
+    unsigned long long pff_local_cnt;   // victims of the process that needed a frame
+} stats;
+
+// RECLAIM THREAD
+// wakes up when an allocation leaves fewer than low_wmark free user
+// pages and evicts until high_wmark pages are free, so that faults
+// seldom have to evict frames themselves
+static size_t low_wmark, high_wmark;
+static struct semaphore reclaim_sema;
+static bool reclaim_awake;
 
-/* Returns true if frame a frame page b. */
-static bool frame_entry_less(const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED)
+// WORKING SETS
+// every PTE that maps a frame counts towards the resident set (rss)
+// of its process.  The page-fault frequency of a process sets how
+// many frames it may keep while memory is short (ws_target): one that
+// faults again within pff_interval ticks of its running time may grow
+// by the page it faults in, one that faults less often shrinks to the
+// pages it referenced since its previous fault.  The clock takes the
+// frames above the targets first, and a process that holds its target
+// replaces its own frames once free memory is down to the reserve of
+// the reclaim thread, so that a thrashing process does not take the
+// working sets of the others.
+#define PFF_INTERVAL_DEFAULT 4
+static int64_t pff_interval; // 0 disables the policy
+static size_t surplus;       // frames held above the targets, in all
+
+static unsigned cache_hash(const struct hash_elem *e, void *aux UNUSED)
 {
-    const struct frame_entry *a = hash_entry(a_, struct frame_entry, elem);
-    const struct frame_entry *b = hash_entry(b_, struct frame_entry, elem);
+    const struct frame *f = hash_entry(e, struct frame, cache_elem);
+    return hash_bytes(&f->inode, sizeof f->inode) ^ hash_int(f->offset);
+}
 
-    return a->addr < b->addr;
+static bool cache_less(const struct hash_elem *a_, const struct hash_elem *b_,
+                       void *aux UNUSED)
+{
+    const struct frame *a = hash_entry(a_, struct frame, cache_elem);
+    const struct frame *b = hash_entry(b_, struct frame, cache_elem);
+    if (a->inode != b->inode)
+        return a->inode < b->inode;
+    if (a->offset != b->offset)
+        return a->offset < b->offset;
+    return a->length < b->length;
 }
 
 void frame_table_init()
 {
-    ASSERT(hash_init(&frame_table, frame_entry_hash, frame_entry_less, NULL));
+    frame_cnt = palloc_page_cnt();
+    frames = calloc(frame_cnt, sizeof *frames);
+    ASSERT(frames != NULL);
+    if (!hash_init(&page_cache, cache_hash, cache_less, NULL))
+        PANIC("frame table: out of memory for the page cache");
     lock_init(&table_lock);
+    cond_init(&evict_done);
+    zero_page = palloc_get_page(PAL_ASSERT | PAL_ZERO);
+}
+
+static struct frame *kaddr_to_frame(void *kaddr)
+{
+    return &frames[palloc_page_no(kaddr)];
+}
+
+static void *frame_to_kaddr(struct frame *f)
+{
+    return palloc_page_addr(f - frames);
+}
+
+// take f out of the page cache, if it is there
+// must be called with table_lock held
+static void cache_drop(struct frame *f)
+{
+    if (f->inode == NULL)
+        return;
+    hash_delete(&page_cache, &f->cache_elem);
+    inode_allow_write(f->inode);
+    inode_close(f->inode);
+    f->inode = NULL;
+    stats.cached_cnt--;
+}
+
+// frames t holds above its target
+static size_t rss_excess(const struct thread *t)
+{
+    return t->rss > t->ws_target ? t->rss - t->ws_target : 0;
+}
+
+// count the PTE of r in the resident set of its owner
+// must be called with table_lock held
+static void rss_link(struct rmap *r)
+{
+    struct thread *t = r->owner;
+
+    surplus -= rss_excess(t);
+    list_push_back(&t->rss_list, &r->rss_elem);
+    t->rss++;
+    surplus += rss_excess(t);
+}
+
+// take the PTE of r out of the resident set of its owner, before r
+// is freed or copied
+// must be called with table_lock held
+static void rss_unlink(struct rmap *r)
+{
+    struct thread *t = r->owner;
+
+    ASSERT(t->rss > 0);
+    surplus -= rss_excess(t);
+    list_remove(&r->rss_elem);
+    t->rss--;
+    surplus += rss_excess(t);
 }
 
-void frame_table_insert(void *kaddr, uint32_t *pte)
+// must be called with table_lock held
+static void rss_set_target(struct thread *t, size_t target)
 {
-    struct pte_elem *pte_elem = malloc(sizeof(struct pte_elem));
-    pte_elem->pte = pte;
+    surplus -= rss_excess(t);
+    t->ws_target = target;
+    surplus += rss_excess(t);
+}
 
-    struct frame_entry entry = {
-        .addr = kaddr,
-    };
+void frame_table_insert(void *kaddr, uint32_t *pte, void *upage, uint32_t origin)
+{
+    struct frame *f = kaddr_to_frame(kaddr);
+    struct thread *cur = thread_current();
+    struct rmap *r;
 
     lock_acquire(&table_lock);
-    struct hash_elem *elem = hash_find(&frame_table, &entry.elem);
-    if (elem == NULL)
+    if (f->map.pte == NULL)
     {
-        struct frame_entry *e = malloc(sizeof(struct frame_entry));
-        ASSERT(e != NULL);
-        e->addr = kaddr;
-        list_init(&e->list);
-        elem = &e->elem;
-
-        ASSERT(hash_insert(&frame_table, &e->elem) == NULL);
+        f->map.pte = pte;
+        f->map.upage = upage;
+        f->map.origin = origin;
+        f->map.owner = cur;
+        rss_link(&f->map);
+        lock_release(&table_lock);
+        return;
     }
+    lock_release(&table_lock);
+
+    // only shared frames cost an allocation, made outside the lock
+    r = malloc(sizeof(struct rmap));
+    ASSERT(r != NULL);
+    r->pte = pte;
+    r->upage = upage;
+    r->origin = origin;
+    r->owner = cur;
 
-    list_push_back(&hash_entry(elem, struct frame_entry, elem)->list, &pte_elem->elem);
+    lock_acquire(&table_lock);
+    if (f->map.pte == NULL)
+    {
+        // the other mappings went away meanwhile
+        f->map.pte = pte;
+        f->map.upage = upage;
+        f->map.origin = origin;
+        f->map.owner = cur;
+        rss_link(&f->map);
+        lock_release(&table_lock);
+        free(r);
+        return;
+    }
+    r->next = f->map.next;
+    f->map.next = r;
+    rss_link(r);
     lock_release(&table_lock);
 }
 
+// take pte out of the PTEs that refer to f, which has others as well,
+// and out of the resident set of its process
+// *old, if not null, is set to the entry of pte
+// return the overflow entry that is no longer used
+// must be called with table_lock held
+static struct rmap *rmap_unlink(struct frame *f, uint32_t *pte, struct rmap *old)
+{
+    struct rmap *r, **rp;
+
+    ASSERT(f->map.next != NULL);
+    if (f->map.pte == pte)
+    {
+        // promote the first overflow entry, which moves in its list
+        rss_unlink(&f->map);
+        if (old != NULL)
+            *old = f->map;
+        r = f->map.next;
+        rss_unlink(r);
+        f->map = *r;
+        rss_link(&f->map);
+        return r;
+    }
+
+    for (rp = &f->map.next; *rp != NULL && (*rp)->pte != pte; rp = &(*rp)->next)
+        ;
+    // there must be an entry to remove
+    ASSERT(*rp != NULL);
+    r = *rp;
+    *rp = r->next;
+    rss_unlink(r);
+    if (old != NULL)
+        *old = *r;
+    return r;
+}
+
 // remove mapping from frame (kaddr) to user page (pte)
-void frame_table_remove(void *kaddr, uint32_t *pte)
+bool frame_table_remove(void *kaddr, uint32_t *pte)
 {
-    struct frame_entry entry = {
-        .addr = kaddr,
-    };
+    struct frame *f = kaddr_to_frame(kaddr);
+    struct rmap *r = NULL;
+    bool free_page = false;
+
+    if (kaddr == zero_page)
+        return true;
 
     lock_acquire(&table_lock);
-    struct hash_elem *elem = hash_find(&frame_table, &entry.elem);
-    ASSERT(elem != NULL);
+    // the frame may have been evicted since the caller looked at pte
+    if (!pte_get_present(*pte) || pte_get_page(*pte) != kaddr)
+    {
+        lock_release(&table_lock);
+        return false;
+    }
 
-    // PTE list
-    struct list *list = &hash_entry(elem, struct frame_entry, elem)->list;
-    struct list_elem *e;
-    for (e = list_begin(list); e != list_end(list); e = list_next(e))
+    ASSERT(f->map.pte != NULL);
+    if (f->map.pte == pte && f->map.next == NULL)
+    {
+        ASSERT(f->pin_cnt == 0);
+        rss_unlink(&f->map);
+        f->map.pte = NULL;
+        cache_drop(f);
+        free_page = true;
+    }
+    else
+        r = rmap_unlink(f, pte, NULL);
+    lock_release(&table_lock);
+
+    free(r);
+    if (free_page)
+        palloc_free_page(kaddr);
+    return true;
+}
+
+// COPY-ON-WRITE
+// fork shares every frame of the parent with the child.  Writable
+// pages become read-only with PTE_COW set in both processes; the
+// first write to one of them copies the frame, unless every other
+// PTE has let go of it by then.
+
+// share the frame at kaddr, which parent maps, with child
+// child is left alone unless the frame is shared
+enum frame_fork frame_table_fork(void *kaddr, uint32_t *parent, uint32_t *child)
+{
+    struct frame *f = kaddr_to_frame(kaddr);
+    struct rmap *r, *p;
+    uint32_t v;
+
+    // already read-only, and copy-on-write if writable
+    if (kaddr == zero_page)
+    {
+        *child = *parent;
+        return FRAME_FORK_SHARED;
+    }
+
+    // the new entry is allocated outside the lock
+    r = malloc(sizeof(struct rmap));
+    if (r == NULL)
+        return FRAME_FORK_NO_MEMORY;
+    r->pte = child;
+    r->owner = thread_current();
+
+    lock_acquire(&table_lock);
+    v = *parent;
+    if (!pte_get_present(v) || pte_get_page(v) != kaddr)
+    {
+        lock_release(&table_lock);
+        free(r);
+        return FRAME_FORK_EVICTED;
+    }
+
+    for (p = &f->map; p != NULL && p->pte != parent; p = p->next)
+        ;
+    ASSERT(p != NULL);
+    r->upage = p->upage;
+    r->origin = p->origin;
+    r->next = f->map.next;
+    f->map.next = r;
+    rss_link(r);
+
+    // the parent is blocked until the fork is done, and its TLB
+    // entries go away when the child switches page directories
+    if (v & PTE_W)
+    {
+        v = (v & ~PTE_W) | PTE_COW;
+        *parent = v;
+    }
+    *child = v;
+    stats.fork_cnt++;
+    lock_release(&table_lock);
+    return FRAME_FORK_SHARED;
+}
+
+// give pte, which maps upage to a frame copy-on-write, a private
+// writable copy of the frame; the last PTE that refers to it takes
+// it over instead
+// return false if pte is not a copy-on-write mapping or there is no
+// memory for the copy
+bool frame_table_cow(uint32_t *pte, void *upage)
+{
+    void *copy = NULL;
+    struct rmap *r = NULL;
+    bool done;
+
+    for (;;)
+    {
+        struct frame *f;
+        void *kaddr;
+        uint32_t v;
+
+        lock_acquire(&table_lock);
+        v = *pte;
+        if (!pte_get_present(v) || (v & PTE_COW) == 0)
+        {
+            // evicted meanwhile, the write faults again and loads the
+            // page; or the page is not copy-on-write at all
+            done = !pte_get_present(v) || (v & PTE_W) != 0;
+            break;
+        }
+
+        kaddr = pte_get_page(v);
+        f = kaddr_to_frame(kaddr);
+        if (kaddr == zero_page && copy != NULL)
+        {
+            struct frame *g = kaddr_to_frame(copy);
+
+            memset(copy, 0, PGSIZE);
+            g->map.pte = pte;
+            g->map.upage = upage;
+            g->map.origin = 0;
+            g->map.owner = thread_current();
+            g->map.next = NULL;
+            rss_link(&g->map);
+            *pte = pte_create_user(copy, true) | PTE_A | PTE_D;
+            copy = NULL;
+            stats.zero_copy_cnt++;
+            done = true;
+            break;
+        }
+        if (kaddr != zero_page && f->map.pte == pte && f->map.next == NULL)
+        {
+            // the other processes let go of the frame
+            *pte = (v & ~PTE_COW) | PTE_W;
+            stats.cow_reuse_cnt++;
+            done = true;
+            break;
+        }
+
+        if (kaddr != zero_page && copy != NULL)
+        {
+            struct frame *g = kaddr_to_frame(copy);
+            struct rmap old;
+
+            // the copy takes the place of the shared frame in the
+            // resident set
+            memcpy(copy, kaddr, PGSIZE);
+            r = rmap_unlink(f, pte, &old);
+            g->map = old;
+            g->map.pte = pte;
+            g->map.upage = upage;
+            g->map.next = NULL;
+            rss_link(&g->map);
+            *pte = pte_create_user(copy, true) | PTE_A | PTE_D;
+            copy = NULL;
+            stats.cow_copy_cnt++;
+            done = true;
+            break;
+        }
+        lock_release(&table_lock);
+
+        // allocating may evict, which needs the lock
+        copy = frame_table_alloc();
+        if (copy == NULL)
+            return false;
+    }
+    lock_release(&table_lock);
+
+    free(r);
+    if (copy != NULL)
+        palloc_free_page(copy);
+    pagedir_flush_range(thread_current()->pagedir, upage, PGSIZE);
+    return done;
+}
+
+// map pte to the frame in the page cache that holds length bytes of
+// inode at offset, if there is one
+// upage and origin are as for frame_table_insert
+// return the kernel address of the frame, null if it is not cached
+void *frame_table_share(struct inode *inode, off_t offset, size_t length,
+                        uint32_t *pte, void *upage, uint32_t origin)
+{
+    struct frame key, *f;
+    struct hash_elem *e;
+    struct rmap *r;
+    void *kaddr = NULL;
+
+    // the new entry is allocated outside the lock
+    r = malloc(sizeof(struct rmap));
+    if (r == NULL)
+        return NULL;
+    r->pte = pte;
+    r->upage = upage;
+    r->origin = origin;
+    r->owner = thread_current();
+
+    key.inode = inode;
+    key.offset = offset;
+    key.length = length;
+
+    lock_acquire(&table_lock);
+    e = hash_find(&page_cache, &key.cache_elem);
+    if (e != NULL)
+    {
+        f = hash_entry(e, struct frame, cache_elem);
+        ASSERT(f->map.pte != NULL);
+        kaddr = frame_to_kaddr(f);
+        r->next = f->map.next;
+        f->map.next = r;
+        rss_link(r);
+        *pte = pte_create_user(kaddr, false);
+        stats.share_cnt++;
+    }
+    lock_release(&table_lock);
+
+    if (kaddr == NULL)
+        free(r);
+    return kaddr;
+}
+
+// add the frame at kaddr, which pte maps read-only and which holds
+// length bytes of inode at offset, to the page cache
+void frame_table_cache(void *kaddr, uint32_t *pte, struct inode *inode,
+                       off_t offset, size_t length)
+{
+    struct frame *f = kaddr_to_frame(kaddr);
+
+    lock_acquire(&table_lock);
+    // the frame may have been evicted and reused since it was loaded
+    if (pte_get_present(*pte) && pte_get_page(*pte) == kaddr &&
+        f->inode == NULL)
+    {
+        f->inode = inode;
+        f->offset = offset;
+        f->length = length;
+        // another process may have cached the same page meanwhile
+        if (hash_insert(&page_cache, &f->cache_elem) == NULL)
+        {
+            // the file stays as cached until the frame leaves the
+            // cache, even if the areas that denied writes go first
+            f->inode = inode_reopen(inode);
+            inode_deny_write(f->inode);
+            if (++stats.cached_cnt > stats.cached_max)
+                stats.cached_max = stats.cached_cnt;
+        }
+        else
+            f->inode = NULL;
+    }
+    lock_release(&table_lock);
+}
+
+// true if the page can be dropped and loaded again from where it
+// came from, as long as it has not been written: it was loaded from
+// its area, not from swap
+static bool origin_is_backed(uint32_t origin)
+{
+    return origin == 0;
+}
+
+// true if a PTE of process t refers to f
+static bool frame_mapped_by(struct frame *f, struct thread *t)
+{
+    struct rmap *r;
+
+    for (r = &f->map; r != NULL; r = r->next)
+        if (r->owner == t)
+            return true;
+    return false;
+}
+
+// true if f is not protected by the working-set targets from an
+// eviction for local: a process that refers to it holds more than its
+// target, or is local
+static bool frame_unprotected(struct frame *f, struct thread *local)
+{
+    struct rmap *r;
+
+    for (r = &f->map; r != NULL; r = r->next)
+        if (r->owner == local || r->owner->rss > r->owner->ws_target)
+            return true;
+    return false;
+}
+
+// CLOCK
+// the hand sweeps the frames in physical order and keeps its
+// position between evictions.  Referenced frames lose their
+// accessed bits and are passed over.  Clean unreferenced frames are
+// taken at once; if none shows up within CLOCK_SCAN_LIMIT
+// frames in use, the first unreferenced dirty frame is taken.
+// protect passes over the frames that are protected from local, see
+// frame_unprotected, without touching them
+// the TLB entries of the accessed bits it clears go into tlb, so
+// that the CPU sets them again on the next access
+// *scanned is increased by the frames looked at
+// must be called with table_lock held
+static struct frame *clock_sweep(struct pagedir_batch *tlb, bool protect,
+                                 struct thread *local, size_t *scanned)
+{
+    struct frame *f, *victim = NULL, *dirty_victim = NULL;
+    struct rmap *r;
+    size_t steps, looked = 0;
+
+    // two full turns always find a frame: the first clears every
+    // accessed bit it passes
+    for (steps = 0; steps < 2 * frame_cnt && victim == NULL; steps++)
     {
-        if (list_entry(e, struct pte_elem, elem)->pte == pte)
+        bool access = false;
+        bool dirty = false;
+
+        f = &frames[clock_hand];
+        clock_hand = (clock_hand + 1) % frame_cnt;
+        if (f->map.pte == NULL)
+            continue;
+        if (f->pin_cnt > 0)
         {
-            list_remove(e);
-            if (list_empty(list))
+            stats.pin_skip_cnt++;
+            continue;
+        }
+        if (protect && !frame_unprotected(f, local))
+            continue;
+        looked++;
+
+        for (r = &f->map; r != NULL; r = r->next)
+        {
+            dirty = dirty || pte_get_dirty(*r->pte);
+            if (pte_get_access(*r->pte))
             {
-                // free page
-                palloc_free_page(kaddr);
-                ASSERT(hash_delete(&frame_table, elem) != NULL);
+                access = true;
+                pte_clear_access(r->pte);
+                pagedir_batch_add(tlb, r->pte, r->upage);
             }
-            lock_release(&table_lock);
-            return;
         }
-    }
 
-    // there must be an elem be removed in the loop
-    NOT_REACHED();
+        if (access)
+            continue;
+        if (!dirty)
+            victim = f;
+        else if (dirty_victim == NULL)
+            dirty_victim = f;
+
+        if (victim == NULL && dirty_victim != NULL && looked >= CLOCK_SCAN_LIMIT)
+            victim = dirty_victim;
+    }
+    if (victim == NULL)
+        victim = dirty_victim;
+    *scanned += looked;
+    return victim;
 }
 
-static void swap_out_frame(struct frame_entry *f)
+// pick the next frame to evict for local, the process that needs a
+// frame and holds its target, or null: the frames above the targets
+// and those of local first, then any frame
+// must be called with table_lock held
+static struct frame *clock_select(struct pagedir_batch *tlb, struct thread *local)
 {
-    struct list_elem *e;
+    struct frame *victim = NULL;
+    struct rmap *r;
+    size_t scanned = 0;
 
-    bool dirty = false;
-    for (e = list_begin(&f->list); e != list_end(&f->list); e = list_next(e))
+    if (pff_interval != 0 && (local != NULL || surplus > 0))
     {
-        struct pte_elem *p = list_entry(e, struct pte_elem, elem);
-        dirty = dirty || pte_get_dirty(*p->pte);
+        victim = clock_sweep(tlb, true, local, &scanned);
+        if (victim != NULL && local != NULL && frame_mapped_by(victim, local))
+            stats.pff_local_cnt++;
+        else if (victim != NULL)
+            stats.pff_surplus_cnt++;
+    }
+    if (victim == NULL)
+        victim = clock_sweep(tlb, false, NULL, &scanned);
 
+    if (victim != NULL)
+    {
+        bool dirty = false;
+        for (r = &victim->map; r != NULL; r = r->next)
+            dirty = dirty || pte_get_dirty(*r->pte);
+
+        stats.evict_cnt++;
+        stats.scan_cnt += scanned;
+        if (scanned > stats.scan_max)
+            stats.scan_max = scanned;
         if (dirty)
+            stats.dirty_cnt++;
+        else
+            stats.clean_cnt++;
+    }
+    return victim;
+}
+
+// a frame taken out of the table by frame_table_evict
+struct victim
+{
+    void *page;
+    struct rmap map;  // the PTEs that referred to the frame
+    bool swap;        // must be written to swap before it is reused
+    swapid_t id;      // where it was written, SWAP_ERROR if it was not
+};
+
+// take f out of the table and mark all of its PTEs MEM_EVICTING, so
+// that the owners wait in frame_table_wait instead of using it
+// the TLB entries of the PTEs go into tlb
+// must be called with table_lock held
+static void victim_detach(struct frame *f, struct victim *v,
+                          struct pagedir_batch *tlb)
+{
+    struct rmap *r;
+    bool dirty = false, backed = true;
+    enum intr_level old_level;
+
+    // the PTEs leave the resident sets before the entries are copied
+    for (r = &f->map; r != NULL; r = r->next)
+        rss_unlink(r);
+    v->page = frame_to_kaddr(f);
+    v->map = f->map;
+    v->id = SWAP_ERROR;
+    f->map.pte = NULL;
+    f->map.next = NULL;
+    cache_drop(f);
+
+    // the owner must not slip a write in between
+    old_level = intr_disable();
+    for (r = &v->map; r != NULL; r = r->next)
+    {
+        uint32_t pte = *r->pte;
+        dirty = dirty || pte_get_dirty(pte);
+        backed = backed && origin_is_backed(r->origin);
+        // a copy-on-write page is writable once it is loaded again
+        pte_set(r->pte, MEM_EVICTING,
+                pte_get_writable(pte) || (pte & PTE_COW) ? 1 : 0);
+        pagedir_batch_add(tlb, r->pte, r->upage);
+    }
+    intr_set_level(old_level);
+
+    v->swap = dirty || !backed;
+}
+
+// point the PTEs of v to its swap block, or back to where the page
+// came from
+// the PTEs of a shared frame share the swap block, each with a
+// reference of its own
+// return false, with the frame back in the table, if v had to be
+// written to swap but was not
+// must be called with table_lock held
+static bool victim_finish(struct victim *v)
+{
+    struct rmap *r;
+    bool shared = v->map.next != NULL;
+
+    for (r = &v->map; r != NULL; r = r->next)
+    {
+        bool writable = pte_vm_area_x(*r->pte) & 1;
+        if (!v->swap)
+            *r->pte = r->origin;
+        else if (v->id != SWAP_ERROR)
         {
+            if (r != &v->map)
+                swap_dup(v->id);
+            vm_area_swap(r->pte, v->id, writable);
         }
+        else if (shared && writable)
+            // swap is full, put the page back
+            *r->pte = pte_create_user(v->page, false) | PTE_COW | PTE_D;
+        else
+            *r->pte = pte_create_user(v->page, writable) | PTE_D;
+    }
+
+    if (v->swap && v->id == SWAP_ERROR)
+    {
+        struct frame *f = kaddr_to_frame(v->page);
 
-        // TODO: no sharing
-        break;
+        f->map = v->map;
+        for (r = &f->map; r != NULL; r = r->next)
+            rss_link(r);
+        stats.swap_full_cnt++;
+        return false;
     }
+    if (v->swap)
+        stats.swap_out_cnt++;
+
+    while (v->map.next != NULL)
+    {
+        r = v->map.next;
+        v->map.next = r->next;
+        free(r);
+    }
+    return true;
 }
 
-// CLOCK
-void *frame_table_evict()
+// write the victims that need it to swap
+// the swap layer keeps those that compress well in RAM and writes
+// the rest to consecutive blocks with one transfer if it can
+static void victims_swap_out(struct victim *victims, size_t cnt)
 {
-    struct hash_iterator it;
-    struct list_elem *e;
-    struct frame_entry *f = NULL;
+    void *pages[SWAP_CLUSTER];
+    swapid_t ids[SWAP_CLUSTER];
+    struct victim *dirty[SWAP_CLUSTER];
+    size_t dirty_cnt = 0, i;
+
+    // order by PTE address: the pages of one process end up next to
+    // each other on swap, in the order of their virtual addresses
+    for (i = 0; i < cnt; i++)
+        if (victims[i].swap)
+        {
+            size_t j = dirty_cnt++;
+            for (; j > 0 && dirty[j - 1]->map.pte > victims[i].map.pte; j--)
+                dirty[j] = dirty[j - 1];
+            dirty[j] = &victims[i];
+        }
+    if (dirty_cnt == 0)
+        return;
+    for (i = 0; i < dirty_cnt; i++)
+        pages[i] = dirty[i]->page;
+
+    swap_out_cluster(pages, dirty_cnt, ids);
+    for (i = 0; i < dirty_cnt; i++)
+        dirty[i]->id = ids[i];
+}
+
+// evict up to max frames, at most SWAP_CLUSTER, at once, so that
+// dirty victims reach swap with a single transfer
+// 1. under the table lock, pick the victims and take them out of
+//    the table (victim_detach)
+// 2. without the lock, write the ones that are dirty or have no
+//    backing store to swap
+// 3. under the lock again, point the PTEs to the swap blocks, or
+//    back to where the pages came from, and wake up the waiters
+// one of the freed frames is returned, the others go back to the
+// user pool for the next allocations
+// a process that holds its working-set target evicts its own frames
+// *freed, if not null, is set to the number of frames evicted, the
+// returned one included
+// return the kernel address of the frame, null on fail
+void *frame_table_evict(size_t max, size_t *freed)
+{
+    struct victim victims[SWAP_CLUSTER];
+    struct pagedir_batch tlb;
+    struct thread *cur = thread_current(), *local = NULL;
+    struct frame *f;
+    size_t cnt = 0, i;
+    void *page = NULL;
 
+    if (freed != NULL)
+        *freed = 0;
+    pagedir_batch_init(&tlb);
     lock_acquire(&table_lock);
-    if (hash_empty(&frame_table))
-        goto done;
-    while (true)
+    // the reclaim thread has no resident set
+    if (pff_interval != 0 && cur->pagedir != NULL &&
+        cur->rss >= cur->ws_target)
+        local = cur;
+    // replacing its own pages, a process gives up only the one it
+    // needs, so that the others do not get the rest
+    if (max > SWAP_CLUSTER)
+        max = SWAP_CLUSTER;
+    if (local != NULL)
+        max = 1;
+    while (cnt < max && (f = clock_select(&tlb, local)) != NULL)
+        victim_detach(f, &victims[cnt++], &tlb);
+    // only the pages of the running process can be in the TLB
+    pagedir_batch_flush(&tlb);
+    if (cnt == 0)
+    {
+        lock_release(&table_lock);
+        return NULL;
+    }
+    lock_release(&table_lock);
+
+    victims_swap_out(victims, cnt);
+
+    lock_acquire(&table_lock);
+    for (i = 0; i < cnt; i++)
+        if (!victim_finish(&victims[i]))
+            victims[i].page = NULL;
+    cond_broadcast(&evict_done, &table_lock);
+    lock_release(&table_lock);
+
+    for (i = 0; i < cnt; i++)
+    {
+        if (victims[i].page == NULL)
+            continue;
+        if (freed != NULL)
+            (*freed)++;
+        if (page == NULL)
+            page = victims[i].page;
+        else
+            palloc_free_page(victims[i].page);
+    }
+    return page;
+}
+
+// map pte read-only to the shared zero page
+// writable makes it copy-on-write
+void frame_table_map_zero(uint32_t *pte, bool writable)
+{
+    *pte = pte_create_user(zero_page, false) | (writable ? PTE_COW : 0);
+}
+
+// wake up the reclaim thread if free user pages are running low
+static void reclaim_wake(void)
+{
+    enum intr_level old_level;
+
+    if (low_wmark == 0 || palloc_free_cnt(PAL_USER) >= low_wmark)
+        return;
+
+    old_level = intr_disable();
+    if (!reclaim_awake)
+    {
+        reclaim_awake = true;
+        stats.wakeup_cnt++;
+        sema_up(&reclaim_sema);
+    }
+    intr_set_level(old_level);
+}
+
+static void reclaim_thread(void *aux UNUSED)
+{
+    enum intr_level old_level;
+    bool stuck, woken;
+
+    for (;;)
     {
-        // first phase: try to find an entry that (A=0, D=0)
-        hash_first(&it, &frame_table);
-        while (hash_next(&it))
+        sema_down(&reclaim_sema);
+        do
         {
-            bool access = false;
-            bool dirty = false;
-            f = hash_entry(hash_cur(&it), struct frame_entry, elem);
-            for (e = list_begin(&f->list); e != list_end(&f->list); e = list_next(e))
+            stuck = false;
+            while (palloc_free_cnt(PAL_USER) < high_wmark)
             {
-                struct pte_elem *p = list_entry(e, struct pte_elem, elem);
-                access = access || pte_get_access(*p->pte);
-                dirty = dirty || pte_get_dirty(*p->pte);
+                // a batch of victims, the dirty ones written together
+                size_t freed;
+                void *page = frame_table_evict(SWAP_CLUSTER, &freed);
+                if (page == NULL)
+                {
+                    stuck = true;
+                    break;
+                }
+                palloc_free_page(page);
+                lock_acquire(&table_lock);
+                stats.reclaim_cnt += freed;
+                lock_release(&table_lock);
             }
-            if (!access && !dirty)
-                goto done;
+
+            // from here on reclaim_wake ups the semaphore again; one
+            // that ran before saw the flag still set, so look at the
+            // free pages once more and take the flag back if they are
+            // low and no wakeup has claimed it meanwhile
+            old_level = intr_disable();
+            reclaim_awake = false;
+            intr_set_level(old_level);
+            if (stuck || palloc_free_cnt(PAL_USER) >= low_wmark)
+                break;
+            old_level = intr_disable();
+            woken = reclaim_awake;
+            reclaim_awake = true;
+            intr_set_level(old_level);
+            // if woken, the semaphore is up and sema_down returns at once
+        } while (!woken);
+    }
+}
+
+void frame_table_start_reclaim(size_t low, size_t high)
+{
+    if (low == SIZE_MAX)
+    {
+        size_t user_cnt = palloc_free_cnt(PAL_USER);
+        low = user_cnt / 32 > SWAP_CLUSTER ? user_cnt / 32 : SWAP_CLUSTER;
+    }
+    if (low == 0)
+        return;
+    if (high == SIZE_MAX)
+        high = 2 * low;
+    if (high < low + SWAP_CLUSTER)
+        high = low + SWAP_CLUSTER;
+
+    low_wmark = low;
+    high_wmark = high;
+    sema_init(&reclaim_sema, 0);
+    thread_create("kswapd", PRI_DEFAULT, reclaim_thread, NULL);
+}
+
+// true if the current process should replace one of its own frames
+// instead of taking a free one: it holds its working-set target and
+// free memory is down to the reserve of the reclaim thread
+static bool alloc_local(void)
+{
+    struct thread *cur = thread_current();
+
+    return pff_interval != 0 && cur->pagedir != NULL &&
+           cur->rss >= cur->ws_target &&
+           palloc_free_cnt(PAL_USER) <= low_wmark;
+}
+
+// get a free user frame, evicting one if the user pool is empty
+// return null on fail
+void *frame_table_alloc(void)
+{
+    bool local = alloc_local();
+    void *page = local ? NULL : palloc_get_page(PAL_USER);
+
+    if (page == NULL)
+    {
+        // a fault needs one frame, the reclaim thread frees the rest
+        page = frame_table_evict(1, NULL);
+        lock_acquire(&table_lock);
+        if (page != NULL)
+            stats.direct_cnt++;
+        lock_release(&table_lock);
+    }
+    // nothing of its own to give up
+    if (page == NULL && local)
+        page = palloc_get_page(PAL_USER);
+    reclaim_wake();
+    return page;
+}
+
+// count the PTEs of t that have been referenced since the previous
+// scan, clearing their accessed bits, whose TLB entries go into tlb
+// must be called with table_lock held
+static size_t ws_scan(struct thread *t, struct pagedir_batch *tlb)
+{
+    struct list_elem *e;
+    size_t cnt = 0;
+
+    for (e = list_begin(&t->rss_list); e != list_end(&t->rss_list);
+         e = list_next(e))
+    {
+        struct rmap *r = list_entry(e, struct rmap, rss_elem);
+        if (pte_get_access(*r->pte))
+        {
+            cnt++;
+            pte_clear_access(r->pte);
+            pagedir_batch_add(tlb, r->pte, r->upage);
         }
+    }
+    return cnt;
+}
+
+void frame_table_set_pff(size_t ticks)
+{
+    pff_interval = ticks == SIZE_MAX ? PFF_INTERVAL_DEFAULT : (int64_t)ticks;
+}
+
+void frame_table_fault(void)
+{
+    struct thread *cur = thread_current();
+    struct pagedir_batch tlb;
+    int64_t interval = cur->run_ticks - cur->last_fault;
+
+    if (pff_interval == 0)
+        return;
 
-        // second phase: try to find an entry that (A=0, D=1), and clear A
-        hash_first(&it, &frame_table);
-        while (hash_next(&it))
+    pagedir_batch_init(&tlb);
+    lock_acquire(&table_lock);
+    cur->last_fault = cur->run_ticks;
+    if (interval < pff_interval)
+    {
+        // faulting often: grow by the page coming in, with memory that
+        // is free or held above the targets of the others
+        if (cur->rss >= cur->ws_target &&
+            (surplus > rss_excess(cur) || palloc_free_cnt(PAL_USER) > low_wmark))
         {
-            bool access = false;
-            f = hash_entry(hash_cur(&it), struct frame_entry, elem);
-            for (e = list_begin(&f->list); e != list_end(&f->list); e = list_next(e))
-            {
-                struct pte_elem *p = list_entry(e, struct pte_elem, elem);
-                access = access || pte_get_access(*p->pte);
-                // clear access
-                pte_clear_access(p->pte);
-            }
-            if (!access)
-                goto done;
+            rss_set_target(cur, cur->rss + 1);
+            stats.pff_grow_cnt++;
         }
     }
-    void *page = NULL;
-done:
-    if (f != NULL)
+    else
     {
-        page = f->addr;
-        // remove f in the hash table
-        hash_delete(&frame_table, &f->elem);
-        swap_out_frame(f);
+        // seldom: keep the pages used since the previous fault, and
+        // the one coming in
+        size_t ws = ws_scan(cur, &tlb);
+        rss_set_target(cur, ws + 1);
+        stats.pff_shrink_cnt++;
+        stats.ws_page_cnt += ws;
     }
+    pagedir_batch_flush(&tlb);
     lock_release(&table_lock);
-    return page;
-}
\ No newline at end of file
+}
+
+// wait until the page of pte is not being evicted
+void frame_table_wait(uint32_t *pte)
+{
+    if (pte_get_present(*pte) || pte_vm_area_type(*pte) != MEM_EVICTING)
+        return;
+
+    lock_acquire(&table_lock);
+    while (!pte_get_present(*pte) && pte_vm_area_type(*pte) == MEM_EVICTING)
+        cond_wait(&evict_done, &table_lock);
+    lock_release(&table_lock);
+}
+
+bool frame_table_pin(uint32_t *pte)
+{
+    struct frame *f;
+    uint32_t v;
+
+    lock_acquire(&table_lock);
+    v = *pte;
+    if (!pte_get_present(v))
+    {
+        lock_release(&table_lock);
+        return false;
+    }
+    // the zero page is never evicted
+    if (pte_get_page(v) != zero_page)
+    {
+        f = kaddr_to_frame(pte_get_page(v));
+        ASSERT(f->map.pte != NULL);
+        f->pin_cnt++;
+        stats.pin_cnt++;
+    }
+    lock_release(&table_lock);
+    return true;
+}
+
+void frame_table_unpin(uint32_t *pte)
+{
+    struct frame *f;
+    uint32_t v;
+
+    lock_acquire(&table_lock);
+    v = *pte;
+    // a pinned frame stays where it is
+    ASSERT(pte_get_present(v));
+    if (pte_get_page(v) != zero_page)
+    {
+        f = kaddr_to_frame(pte_get_page(v));
+        ASSERT(f->pin_cnt > 0);
+        f->pin_cnt--;
+    }
+    lock_release(&table_lock);
+}
+
+void frame_table_print_stats(void)
+{
+    printf("Frame: %llu evictions (%llu clean, %llu dirty), "
+           "%llu frames scanned (max %llu per eviction)\n",
+           stats.evict_cnt, stats.clean_cnt, stats.dirty_cnt,
+           stats.scan_cnt, stats.scan_max);
+    printf("Frame: %llu pages swapped out, %llu evictions failed on full swap\n",
+           stats.swap_out_cnt, stats.swap_full_cnt);
+    printf("Frame: %llu direct evictions, %llu frames reclaimed in the "
+           "background in %llu wakeups (watermarks %zu/%zu)\n",
+           stats.direct_cnt, stats.reclaim_cnt, stats.wakeup_cnt,
+           low_wmark, high_wmark);
+    printf("Frame: %llu faults served from the page cache, %zu frames "
+           "cached (peak %zu)\n",
+           stats.share_cnt, stats.cached_cnt, stats.cached_max);
+    printf("Frame: %llu frames shared by fork, %llu copied on write, "
+           "%llu taken over by their last user\n",
+           stats.fork_cnt, stats.cow_copy_cnt, stats.cow_reuse_cnt);
+    printf("Frame: %llu frames allocated on the first write to the zero page\n",
+           stats.zero_copy_cnt);
+    printf("Frame: %llu frames pinned for system calls, "
+           "passed over %llu times while pinned\n",
+           stats.pin_cnt, stats.pin_skip_cnt);
+    printf("Frame: %llu working-set targets raised, %llu set to working "
+           "sets of %llu pages in all (fault interval %lld ticks)\n",
+           stats.pff_grow_cnt, stats.pff_shrink_cnt, stats.ws_page_cnt,
+           pff_interval);
+    printf("Frame: %llu victims above their targets, %llu replaced by "
+           "their own process, %zu frames above the targets\n",
+           stats.pff_surplus_cnt, stats.pff_local_cnt, surplus);
+}
@@ -1,20 +1,113 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "filesys/off_t.h"
+
+struct inode;
+
 // init frame table
 void frame_table_init(void);
 
-// map from frame (kaddr) to user page (pte)
-void frame_table_insert(void *kaddr, uint32_t *pte);
+// map from frame (kaddr) to user page (pte), which maps upage
+// origin is the not-present pte the page was loaded from
+void frame_table_insert(void *kaddr, uint32_t *pte, void *upage, uint32_t origin);
+
+// PAGE CACHE
+// read-only file pages are shared by every process that maps the
+// same bytes of the same file, as long as they stay in memory
+
+// map pte read-only to the cached frame that holds length bytes of
+// inode at offset, if there is one
+// return the kernel address of the frame, null if it is not cached
+void *frame_table_share(struct inode *inode, off_t offset, size_t length,
+                        uint32_t *pte, void *upage, uint32_t origin);
+
+// add the frame at kaddr, which pte maps read-only and which holds
+// length bytes of inode at offset, to the page cache
+void frame_table_cache(void *kaddr, uint32_t *pte, struct inode *inode,
+                       off_t offset, size_t length);
 
 // remove mapping from frame (kaddr) to user page (pte)
-void frame_table_remove(void *kaddr, uint32_t *pte);
+// return false if pte no longer maps kaddr because the frame has
+// been evicted
+bool frame_table_remove(void *kaddr, uint32_t *pte);
+
+// COPY-ON-WRITE
+// frames are shared between a parent and the child it forks, read-only
+// with PTE_COW set, until one of them writes to the page
 
-// return the kernel address of the frame
+enum frame_fork
+{
+    FRAME_FORK_SHARED,    // child maps the frame as well
+    FRAME_FORK_EVICTED,   // parent no longer maps it, look at parent again
+    FRAME_FORK_NO_MEMORY, // no memory to track another mapping
+};
+
+// share the frame at kaddr, which parent maps, with child
+// child is left alone unless the frame is shared
+enum frame_fork frame_table_fork(void *kaddr, uint32_t *parent, uint32_t *child);
+
+// give pte, which maps upage to a frame copy-on-write, a private
+// writable copy of the frame
+// return false if pte is not a copy-on-write mapping or there is no
+// memory for the copy
+bool frame_table_cow(uint32_t *pte, void *upage);
+
+// map pte read-only to the shared zero page, which holds no data
+// writable makes it copy-on-write, so that the first write gets a
+// zeroed frame of its own
+void frame_table_map_zero(uint32_t *pte, bool writable);
+
+// evict up to max frames, writing the dirty ones to swap together
+// *freed, if not null, is set to the number of frames evicted
+// return the kernel address of one of them, the others are freed
 // return null on fail
-void *frame_table_evict(void);
+void *frame_table_evict(size_t max, size_t *freed);
+
+// get a free user frame, evicting one if needed
+// return null on fail
+void *frame_table_alloc(void);
+
+// start the reclaim thread, which evicts frames in the background
+// whenever fewer than low free user pages are left, until there are
+// high of them
+// low of 0 leaves all eviction to frame_table_alloc
+// SIZE_MAX picks low from the size of the user pool and high as
+// twice low
+void frame_table_start_reclaim(size_t low, size_t high);
+
+// WORKING SETS
+// page-fault frequency decides how many frames each process keeps
+// while memory is short, see vm/frame.c
+
+// a process that faults again within ticks of running time grows its
+// working-set target, one that faults less often shrinks it
+// 0 disables the policy, SIZE_MAX picks the default
+void frame_table_set_pff(size_t ticks);
+
+// the current process has handled a page fault, once for each
+void frame_table_fault(void);
+
+// wait until the page of pte is not being evicted
+void frame_table_wait(uint32_t *pte);
+
+// PINNING
+// a pinned frame is never evicted, so that a system call can use a
+// user buffer while it holds file system locks, without page faults
+
+// pin the frame that pte maps
+// return false if pte does not map a frame, because it has been
+// evicted meanwhile
+bool frame_table_pin(uint32_t *pte);
+
+// undo one frame_table_pin of the frame that pte maps
+void frame_table_unpin(uint32_t *pte);
+
+// print eviction statistics
+void frame_table_print_stats(void);
 
 #endif /* vm/frame.h */
@@ -1,48 +1,162 @@
 #include "vm/swap.h"
 
 #include <bitmap.h>
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "devices/block.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/vaddr.h"
 #include "threads/synch.h"
+#include "vm/zswap.h"
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
 
 static struct block *swap_block;
 static struct bitmap *swap_bits;
 static size_t block_cnt;
 static struct lock lock;
 
-void swap_init()
+// SLOT ALLOCATOR
+// next fit: a search starts where the previous allocation ended, so
+// pages written one after another get adjacent blocks and the
+// blocks before the cursor, which are likely in use, are not
+// scanned again.  free_cnt lets a full device fail at once.
+static size_t cursor;
+static size_t free_cnt;
+
+// PTEs that refer to each block: forked processes share the blocks
+// of the pages they had swapped out until they read them back
+static uint16_t *slot_refs;
+
+// clustered transfers go through this buffer of SWAP_CLUSTER pages,
+// so that the device sees one run of sectors
+static uint8_t *cluster_buf;
+
+// swap I/O statistics, ticks are spent inside the device transfers
+static struct
 {
-    swap_block = block_get_role(BLOCK_SWAP);
-    ASSERT(swap_block != NULL);
+    unsigned long long in_cnt;  // pages read
+    unsigned long long out_cnt; // pages written
+    unsigned long long in_cmds; // device transfers issued for reads
+    unsigned long long out_cmds;
+    int64_t in_ticks;
+    int64_t out_ticks;
+    unsigned long long zswap_in_cnt;  // pages read from the compressed cache
+    unsigned long long zswap_out_cnt; // pages that never reached the device
+} stats;
 
-    block_sector_t size = block_size(swap_block);
+void swap_init(void)
+{
+    // without a swap device, every swap_out fails
+    swap_block = block_get_role(BLOCK_SWAP);
+    block_sector_t size = swap_block != NULL ? block_size(swap_block) : 0;
     block_cnt = size * BLOCK_SECTOR_SIZE / PGSIZE;
 
     swap_bits = bitmap_create(block_cnt);
     ASSERT(swap_bits != NULL);
+    free_cnt = block_cnt;
+    slot_refs = calloc(block_cnt > 0 ? block_cnt : 1, sizeof *slot_refs);
+    ASSERT(slot_refs != NULL);
+
+    if (block_cnt > 0)
+        cluster_buf = palloc_get_multiple(PAL_ASSERT, SWAP_CLUSTER);
 
     lock_init(&lock);
 }
 
 static block_sector_t swap_id_to_sector(swapid_t id)
 {
-    return id * (PGSIZE / BLOCK_SECTOR_SIZE);
+    return id * SECTORS_PER_PAGE;
+}
+
+// allocate cnt consecutive blocks
+// return the first one, SWAP_ERROR if there is no such run
+// must be called with lock held
+static swapid_t slot_alloc(size_t cnt)
+{
+    size_t id, i;
+
+    if (free_cnt < cnt)
+        return SWAP_ERROR;
+
+    id = bitmap_scan_and_flip(swap_bits, cursor, cnt, false);
+    if (id == BITMAP_ERROR && cursor != 0)
+        // wrap around
+        id = bitmap_scan_and_flip(swap_bits, 0, cnt, false);
+    if (id == BITMAP_ERROR)
+        return SWAP_ERROR;
+
+    for (i = 0; i < cnt; i++)
+        slot_refs[id + i] = 1;
+    free_cnt -= cnt;
+    cursor = id + cnt < block_cnt ? id + cnt : 0;
+    return id;
+}
+
+// release cnt consecutive blocks starting at id
+// must be called with lock held
+static void slot_free(swapid_t id, size_t cnt)
+{
+    ASSERT(bitmap_all(swap_bits, id, cnt));
+    bitmap_set_multiple(swap_bits, id, cnt, false);
+    free_cnt += cnt;
+}
+
+// drop a reference to block id, release it with the last one
+// must be called with lock held
+static void slot_put(swapid_t id)
+{
+    ASSERT(slot_refs[id] > 0);
+    if (--slot_refs[id] == 0)
+        slot_free(id, 1);
+}
+
+// read cnt pages starting at block id into buf
+// must be called with lock held
+static void read_pages(swapid_t id, void *buf, size_t cnt)
+{
+    int64_t start = timer_ticks();
+    block_read_multiple(swap_block, swap_id_to_sector(id),
+                        cnt * SECTORS_PER_PAGE, buf);
+    stats.in_ticks += timer_elapsed(start);
+    stats.in_cnt += cnt;
+    stats.in_cmds++;
+}
+
+// write cnt pages from buf starting at block id
+// must be called with lock held
+static void write_pages(swapid_t id, const void *buf, size_t cnt)
+{
+    int64_t start = timer_ticks();
+    block_write_multiple(swap_block, swap_id_to_sector(id),
+                         cnt * SECTORS_PER_PAGE, buf);
+    stats.out_ticks += timer_elapsed(start);
+    stats.out_cnt += cnt;
+    stats.out_cmds++;
 }
 
 // read from swap to main memory
-// release a swap block
+// drop a reference to the swap block
 void swap_in(swapid_t id, void *page)
 {
+    if (zswap_owns(id))
+    {
+        zswap_load(id, page);
+        lock_acquire(&lock);
+        stats.zswap_in_cnt++;
+        lock_release(&lock);
+        return;
+    }
+
     lock_acquire(&lock);
     ASSERT(bitmap_test(swap_bits, id));
-
-    block_sector_t sector = swap_id_to_sector(id);
-    size_t size = 0;
-    for (; size < PGSIZE; size += BLOCK_SECTOR_SIZE)
-        block_read(swap_block, sector++, page);
-
-    bitmap_flip(swap_bits, id);
+    read_pages(id, page, 1);
+    slot_put(id);
     lock_release(&lock);
 }
 
@@ -50,18 +164,142 @@ void swap_in(swapid_t id, void *page)
 // allocate a swap block
 swapid_t swap_out(void *page)
 {
+    swapid_t ids[1];
+
+    swap_out_cluster(&page, 1, ids);
+    return ids[0];
+}
+
+// pages that compress well stay in RAM, the rest go to consecutive
+// swap blocks in one transfer, or one by one if there is no free run
+// of blocks long enough
+size_t swap_out_cluster(void **pages, size_t cnt, swapid_t *ids)
+{
+    void *disk[SWAP_CLUSTER];
+    size_t disk_idx[SWAP_CLUSTER];
+    size_t disk_cnt = 0, stored = 0, i;
+    swapid_t id;
+
+    ASSERT(cnt > 0 && cnt <= SWAP_CLUSTER);
+    for (i = 0; i < cnt; i++)
+    {
+        ids[i] = zswap_store(pages[i]);
+        if (ids[i] != SWAP_ERROR)
+            stored++;
+        else
+        {
+            disk[disk_cnt] = pages[i];
+            disk_idx[disk_cnt++] = i;
+        }
+    }
+
     lock_acquire(&lock);
-    size_t id = bitmap_scan_and_flip(swap_bits, 0, block_cnt, false);
+    stats.zswap_out_cnt += stored;
+    id = disk_cnt > 1 ? slot_alloc(disk_cnt) : SWAP_ERROR;
+    if (id != SWAP_ERROR)
+    {
+        for (i = 0; i < disk_cnt; i++)
+        {
+            memcpy(cluster_buf + i * PGSIZE, disk[i], PGSIZE);
+            ids[disk_idx[i]] = id + i;
+        }
+        write_pages(id, cluster_buf, disk_cnt);
+        stored += disk_cnt;
+    }
+    else
+        for (i = 0; i < disk_cnt; i++)
+        {
+            id = slot_alloc(1);
+            if (id == SWAP_ERROR)
+                break;
+            write_pages(id, disk[i], 1);
+            ids[disk_idx[i]] = id;
+            stored++;
+        }
+    lock_release(&lock);
+    return stored;
+}
 
-    block_sector_t sector = swap_id_to_sector(id);
-    size_t size = 0;
-    for (; size < PGSIZE; size += BLOCK_SECTOR_SIZE)
-        block_write(swap_block, sector++, page);
+// read cnt consecutive swap blocks in one transfer and drop a
+// reference to each
+size_t swap_in_cluster(swapid_t id, void **pages, size_t cnt)
+{
+    size_t i;
+
+    ASSERT(cnt > 0 && cnt <= SWAP_CLUSTER);
+    // the compressed cache holds its pages in RAM
+    if (zswap_owns(id))
+    {
+        for (i = 0; i < cnt; i++)
+            swap_in(id + i, pages[i]);
+        return 0;
+    }
+    if (cnt == 1)
+    {
+        swap_in(id, pages[0]);
+        return PGSIZE;
+    }
 
-    goto success;
-fail:
-    bitmap_flip(swap_bits, id);
-success:
+    lock_acquire(&lock);
+    ASSERT(bitmap_all(swap_bits, id, cnt));
+    read_pages(id, cluster_buf, cnt);
+    for (i = 0; i < cnt; i++)
+    {
+        memcpy(pages[i], cluster_buf + i * PGSIZE, PGSIZE);
+        slot_put(id + i);
+    }
     lock_release(&lock);
-    return id;
+    return cnt * PGSIZE;
+}
+
+// add a reference to a swap block
+void swap_dup(swapid_t id)
+{
+    if (zswap_owns(id))
+    {
+        zswap_dup(id);
+        return;
+    }
+
+    lock_acquire(&lock);
+    ASSERT(bitmap_test(swap_bits, id) && slot_refs[id] < UINT16_MAX);
+    slot_refs[id]++;
+    lock_release(&lock);
+}
+
+// drop a reference to a swap block without reading it
+void swap_free(swapid_t id)
+{
+    if (zswap_owns(id))
+    {
+        zswap_free(id);
+        return;
+    }
+
+    lock_acquire(&lock);
+    slot_put(id);
+    lock_release(&lock);
+}
+
+// KB moved per second of device time, 0 if no time was measured
+static unsigned long long swap_rate(unsigned long long pages, int64_t ticks)
+{
+    if (ticks <= 0)
+        return 0;
+    return pages * (PGSIZE / 1024) * TIMER_FREQ / ticks;
+}
+
+void swap_print_stats(void)
+{
+    printf("Swap: %llu pages in with %llu transfers (%llu KB/s), "
+           "%llu pages out with %llu transfers (%llu KB/s)\n",
+           stats.in_cnt, stats.in_cmds, swap_rate(stats.in_cnt, stats.in_ticks),
+           stats.out_cnt, stats.out_cmds,
+           swap_rate(stats.out_cnt, stats.out_ticks));
+    printf("Swap: %zu of %zu blocks free\n", free_cnt, block_cnt);
+    printf("Swap: %llu of %llu pages in from the compressed cache, "
+           "%llu page writes saved\n",
+           stats.zswap_in_cnt, stats.zswap_in_cnt + stats.in_cnt,
+           stats.zswap_out_cnt);
+    zswap_print_stats();
 }
@@ -1,16 +1,52 @@
 #ifndef VM_SWAP_H
 #define VM_SWAP_H
 
+#include <stddef.h>
 #include <stdbool.h>
 
 typedef size_t swapid_t;
-void swap_init();
+
+// returned by swap_out when the swap device is full
+#define SWAP_ERROR ((swapid_t)-1)
+
+// most pages moved by one clustered transfer
+#define SWAP_CLUSTER 8
+
+void swap_init(void);
+
+// a swap block is shared by every PTE that refers to it, and is
+// released when the last of them lets go of it
 
 // read from swap to main memory
-// release a swap block
+// drop a reference to the swap block
 void swap_in(swapid_t, void *);
 
-// write to swap
+// write to swap, or to the compressed cache if the page compresses
+// well
 // allocate a swap block
+// return SWAP_ERROR if there is no free block
 swapid_t swap_out(void *);
-#endif
\ No newline at end of file
+
+// write cnt pages (at most SWAP_CLUSTER) to swap, the ones that go
+// to the device in consecutive blocks with a single transfer
+// ids[i] is set to the block of pages[i], SWAP_ERROR if there was
+// no room for it
+// return the number of pages written
+size_t swap_out_cluster(void **pages, size_t cnt, swapid_t *ids);
+
+// read the cnt consecutive swap blocks starting at id (at most
+// SWAP_CLUSTER) with a single device transfer and drop a reference
+// to each
+// return the bytes read from the device, 0 if the compressed cache
+// held the blocks
+size_t swap_in_cluster(swapid_t id, void **pages, size_t cnt);
+
+// add a reference to a swap block, for a PTE that shares it
+void swap_dup(swapid_t);
+
+// drop a reference to a swap block without reading it
+void swap_free(swapid_t);
+
+// print swap I/O statistics
+void swap_print_stats(void);
+#endif
@@ -1,251 +1,1104 @@
 #include "vm/vm_area.h"
 
 #include <hash.h>
+#include <round.h>
 #include "userprog/pagedir.h"
 #include "threads/malloc.h"
 #include "threads/vaddr.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/vmalloc.h"
 #include "userprog/process.h"
 #include "filesys/file.h"
+#include "filesys/inode.h"
+#include "vm/frame.h"
+#include "vm/fault.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include <stdio.h>
+#include <string.h>
+#include <syscall-nr.h>
 
-/* *
- * PTE
- * --------------------------------------------
- * |                           |   type   | 0 |
- * --------------------------------------------
- *           28 bits            3 bits    1 bit
- * */
-#define PTE_VM_AREA_BITMAP (0xfffffff0)
-#define PTE_VM_AREA_SIZE_CHECK(_x)       \
-    do                                   \
-    {                                    \
-        uint32_t __x = (uint32_t)(_x);   \
-        ASSERT((__x & 0xf0000000) == 0); \
-    } while (0)
-
-enum mem_area_type
-{
-    MEM_ZERO = 0x1,
-    MEM_SWAP = 0x2,
-    MEM_MAP = 0x3,
-};
+// FAULT-AROUND
+// a fault in a file mapping also maps the pages around it that are
+// not present yet, as long as free frames are at hand.  A fault
+// right after the pages mapped by the previous one is taken as
+// sequential access and doubles the read-ahead window.
+#define FAULT_AROUND_MIN 4  // pages, a power of 2
+#define FAULT_AROUND_MAX 32
 
-#define pte_vm_area_type(pte) ((enum mem_area_type)(((pte)&0xf) >> 1))
-#define pte_vm_area_x(pte) ((uint32_t)(((pte)&PTE_VM_AREA_BITMAP) >> 4))
+// STACK
+// the stack is a zero-filled area that grows down from
+// PHYS_BASE on faults near esp, up to stack_limit bytes.  A fault
+// right below the stack is taken as the stack running down
+// sequentially: it reserves STACK_GROW_BATCH pages at once and maps
+// the ones below the fault into frames that are free.
+#define STACK_LIMIT_DEFAULT (8 * 1024 * 1024)
+#define STACK_LIMIT_MAX (64 * 1024 * 1024)
+#define STACK_GROW_BATCH 8 // pages
 
-static void pte_set(uint32_t *pte, enum mem_area_type type, uint32_t x)
-{
-    uint32_t t = 0;
-    t |= (x << 4);
+// PUSHA writes 32 bytes below esp before it moves esp
+#define STACK_SLACK 32
 
-    uint32_t tp = type & 0x07; // 3 bits
-    t |= (tp << 1);
+// HEAP
+// the heap is a zero-filled area right after the data segments that
+// sbrk() stretches and shrinks; it has no area while it is empty.
+// It may grow up to where the stack could grow down to.
+#define SBRK_FAILED ((void *)-1)
 
-    *pte = t;
-}
+// WRITEBACK
+// munmap and exit write the dirty pages of shared mappings back to
+// the file.  Runs of consecutive dirty pages are copied into a bounce
+// buffer of up to WRITEBACK_PAGES pages and written with a single
+// file_write_at, so no file system lock is held while the pages are
+// faulted back in from swap.
+#define WRITEBACK_PAGES 16
 
-// mmap: id -> fd, offset, size
-struct mmap_entry
+static size_t stack_limit = STACK_LIMIT_DEFAULT;
+
+// AREAS
+// the address space of a process is a set of areas, sorted by
+// address in an array of pointers that is searched by bisection.  An
+// area reserves its pages without touching the page table: a PTE is
+// only filled in when the page is loaded, and a PTE of 0 inside an
+// area stands for a page that is loaded from the area, zero-filled or
+// read from the file, on the next fault.  Not-present PTEs are only
+// left for the pages that are swapped out or on their way there.
+// file mappings are also kept in a hash by id, for munmap.
+struct vm_area
 {
-    struct hash_elem elem;
-    int32_t id;
-    int fd;
-    off_t off;
-    size_t size;
+    void *start; // first page
+    void *end;   // past the last page
     bool writable;
-    void *start_addr;
+    int advice;  // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+
+    // file mapping; file is null for zero-filled memory
+    struct file *file; // own handle, so that close() keeps the mapping
+    off_t off;
+    size_t size;  // bytes of the file mapped from start
+    bool shared;  // dirty pages go back to the file on unmap
+    int32_t id;
+    struct hash_elem elem;
+    void *next_fault; // where a sequential fault is expected
+    size_t window;    // pages to read ahead on the next fault
 };
 
+// initial capacity of the area array
+#define AREAS_MIN 8
+
+// file mapping statistics
+static struct
+{
+    unsigned long long fault_cnt;  // faults in file mappings
+    unsigned long long page_cnt;   // pages read from the file
+    unsigned long long around_cnt; // pages mapped around the fault
+    int64_t read_ticks;
+    unsigned long long write_cnt;      // file_write_at calls on unmap
+    unsigned long long write_page_cnt; // dirty pages written back
+} map_stats;
+
+// read faults served by the shared zero page
+static unsigned long long zero_page_cnt;
+
+// madvise statistics
+static struct
+{
+    unsigned long long willneed_cnt; // pages read in ahead of use
+    unsigned long long dontneed_cnt; // pages released
+} advise_stats;
+
+// stack growth statistics
+static struct
+{
+    unsigned long long fault_cnt; // faults that grew the stack
+    unsigned long long page_cnt;  // pages reserved
+    unsigned long long ahead_cnt; // pages mapped below the fault
+} stack_stats;
+
 static unsigned mmap_entry_hash(const struct hash_elem *p_, void *AUX UNUSED)
 {
-    struct mmap_entry *p = hash_entry(p_, struct mmap_entry, elem);
+    struct vm_area *p = hash_entry(p_, struct vm_area, elem);
     return hash_bytes(&p->id, sizeof(int32_t));
 }
 
 static bool mmap_entry_less(const struct hash_elem *a_, const struct hash_elem *b_, void *AUX UNUSED)
 {
-    struct mmap_entry *a = hash_entry(a_, struct mmap_entry, elem);
-    struct mmap_entry *b = hash_entry(b_, struct mmap_entry, elem);
+    struct vm_area *a = hash_entry(a_, struct vm_area, elem);
+    struct vm_area *b = hash_entry(b_, struct vm_area, elem);
     return a->id > b->id;
 }
 
 void vm_area_init(struct thread *t)
 {
     t->next_mmap_id = 1;
+    t->areas = NULL;
+    t->area_cnt = 0;
+    t->area_cap = 0;
+    t->heap_start = t->brk = NULL;
+    fault_process_init(t);
+    list_init(&t->rss_list);
     ASSERT(hash_init(&t->mem_map, mmap_entry_hash, mmap_entry_less, NULL));
 }
 
-static void mmap_hash_free(struct hash_elem *e, void *aux UNUSED)
+// index of the first area of t that ends above addr, area_cnt if
+// there is none
+static size_t area_index(struct thread *t, const void *addr)
+{
+    size_t lo = 0, hi = t->area_cnt;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->areas[mid]->end <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// the area of t that holds addr, null if there is none
+static struct vm_area *area_find(struct thread *t, const void *addr)
+{
+    size_t i = area_index(t, addr);
+
+    if (i < t->area_cnt && t->areas[i]->start <= addr)
+        return t->areas[i];
+    return NULL;
+}
+
+// add a to the areas of the current thread
+// return false if a overlaps another area or out of memory
+static bool area_insert(struct vm_area *a)
+{
+    struct thread *cur = thread_current();
+    size_t i = area_index(cur, a->start);
+
+    if (i < cur->area_cnt && cur->areas[i]->start < a->end)
+        return false;
+    if (cur->area_cnt == cur->area_cap)
+    {
+        size_t cap = cur->area_cap ? cur->area_cap * 2 : AREAS_MIN;
+        struct vm_area **areas = realloc(cur->areas, cap * sizeof *areas);
+        if (areas == NULL)
+            return false;
+        cur->areas = areas;
+        cur->area_cap = cap;
+    }
+    memmove(cur->areas + i + 1, cur->areas + i,
+            (cur->area_cnt - i) * sizeof *cur->areas);
+    cur->areas[i] = a;
+    cur->area_cnt++;
+    return true;
+}
+
+// take a out of the areas of the current thread
+static void area_remove(struct vm_area *a)
+{
+    struct thread *cur = thread_current();
+    size_t i = area_index(cur, a->start);
+
+    ASSERT(i < cur->area_cnt && cur->areas[i] == a);
+    cur->area_cnt--;
+    memmove(cur->areas + i, cur->areas + i + 1,
+            (cur->area_cnt - i) * sizeof *cur->areas);
+}
+
+// a new area of the current thread from upage to upage + size, or
+// null if it does not fit in user space or there is no memory
+static struct vm_area *area_create(void *upage, size_t size, bool writable)
 {
-    struct mmap_entry *m = hash_entry(e, struct mmap_entry, elem);
-    free(m);
+    struct vm_area *a;
+
+    if (pg_ofs(upage) != 0 || size == 0 || !is_user_vaddr(upage) ||
+        ROUND_UP(size, PGSIZE) > (size_t)((uint8_t *)PHYS_BASE - (uint8_t *)upage))
+        return NULL;
+    a = malloc(sizeof *a);
+    if (a == NULL)
+        return NULL;
+    a->start = upage;
+    a->end = upage + ROUND_UP(size, PGSIZE);
+    a->writable = writable;
+    a->advice = MADV_NORMAL;
+    a->file = NULL;
+    a->off = 0;
+    a->size = 0;
+    a->shared = false;
+    a->id = 0;
+    a->next_fault = NULL;
+    a->window = 0;
+    return a;
 }
 
+static void area_free(struct vm_area *a)
+{
+    if (a->file != NULL)
+        file_close(a->file);
+    free(a);
+}
+
+// release the pages of the current thread from start to end, skipping
+// the page tables that were never allocated
+// return the number of pages released
+static size_t area_release(void *start, void *end)
+{
+    uint32_t *pd = thread_current()->pagedir;
+    void *p = start;
+    size_t cnt = 0;
+
+    while (p < end)
+    {
+        uint32_t *pte = pagedir_get_pte(pd, p, false);
+        if (pte == NULL)
+        {
+            p = (void *)ROUND_DOWN((uintptr_t)p, PTSPAN) + PTSPAN;
+            continue;
+        }
+        if (*pte != 0)
+        {
+            vm_area_destroy_pte(pte);
+            cnt++;
+        }
+        p += PGSIZE;
+    }
+    pagedir_flush_range(pd, start, end - start);
+    return cnt;
+}
+
+static void map_writeback(struct vm_area *m, void *start, void *end);
+
 // free
 void vm_area_free(struct thread *t)
 {
-    hash_destroy(&t->mem_map, mmap_hash_free);
+    size_t i;
+
+    // writing back copies from user memory, which may fault and look
+    // the areas up, so every one of them stays until all are written
+    for (i = 0; i < t->area_cnt; i++)
+        if (t->areas[i]->shared)
+            map_writeback(t->areas[i], t->areas[i]->start, t->areas[i]->end);
+
+    // the pages themselves go with the page directory
+    for (i = 0; i < t->area_cnt; i++)
+        area_free(t->areas[i]);
+    free(t->areas);
+    t->areas = NULL;
+    t->area_cnt = t->area_cap = 0;
+    hash_destroy(&t->mem_map, NULL);
 }
 
 // If the size not a multiple of PGSIZE, then some bytes in the final mapped
 // page "stick out" beyond the end of the file. Set these bytes to zero.
 // return -1 on failure
-int32_t vm_area_map(void *upage, int fd, off_t off, size_t size, bool writable)
+int32_t vm_area_map(void *upage, int fd, off_t off, size_t size, bool writable,
+                    bool shared)
 {
-    if ((uint32_t)upage % PGSIZE != 0)
-        return -1;
+    struct thread *cur = thread_current();
+    struct vm_area *a;
+    struct file *file;
+
     if (fd <= 1 || off < 0)
         return -1;
+    if ((file = process_fd_get(fd)) == NULL)
+        return -1;
+    if ((a = area_create(upage, size, writable)) == NULL)
+        return -1;
+    if ((a->file = file_reopen(file)) == NULL || !area_insert(a))
+    {
+        area_free(a);
+        return -1;
+    }
+    // the pages of a read-only area may go to the page cache, which
+    // must not hold them while the file can change: writes stay
+    // denied until the area goes, whatever happens to fd
+    if (!writable)
+        file_deny_write(a->file);
 
+    a->off = off;
+    a->size = size;
+    a->shared = shared;
+    a->id = cur->next_mmap_id++;
+    ASSERT(hash_insert(&cur->mem_map, &a->elem) == NULL);
+    return a->id;
+}
+
+bool vm_area_unmap(int32_t mapid)
+{
     struct thread *cur = thread_current();
-    int32_t mapid = cur->next_mmap_id++;
-    PTE_VM_AREA_SIZE_CHECK(mapid);
+    struct vm_area key = {.id = mapid};
+    struct hash_elem *e = hash_find(&cur->mem_map, &key.elem);
+    if (e == NULL)
+        return false;
+
+    struct vm_area *m = hash_entry(e, struct vm_area, elem);
+
+    if (m->shared)
+        map_writeback(m, m->start, m->end);
+    area_release(m->start, m->end);
+
+    hash_delete(&cur->mem_map, &m->elem);
+    area_remove(m);
+    area_free(m);
+    return true;
+}
+
+bool vm_area_zero(void *upage, size_t size, bool writable)
+{
+    struct vm_area *a = area_create(upage, size, writable);
 
-    size_t offset = 0;
-    for (; offset < size; offset += PGSIZE)
+    if (a == NULL)
+        return false;
+    if (!area_insert(a))
     {
-        uint32_t *pte = pagedir_get_pte(cur->pagedir, upage + offset, true);
-        ASSERT(pte != NULL);
-        if (*pte != 0)
-        {
-            // clear all
-            size_t s = 0;
-            for (; s < offset; s += PGSIZE)
-            {
-                uint32_t *pte = pagedir_get_pte(cur->pagedir, upage + s, true);
-                ASSERT(pte != NULL);
-                *pte = 0;
-            }
-            return -1;
-        }
-        pte_set(pte, MEM_MAP, mapid);
+        area_free(a);
+        return false;
     }
+    return true;
+}
 
-    // insert mmap into hash table
-    struct mmap_entry *entry = malloc(sizeof(struct mmap_entry));
-    ASSERT(entry != NULL);
-    entry->id = mapid;
-    entry->fd = fd;
-    entry->off = off;
-    entry->size = size;
-    entry->writable = writable;
-    entry->start_addr = upage;
-    ASSERT(hash_insert(&cur->mem_map, &entry->elem) == NULL);
-    return mapid;
+void vm_area_swap(uint32_t *pte, swapid_t id, bool writable)
+{
+    pte_set(pte, MEM_SWAP, (id << 1) | (writable ? 1 : 0));
 }
 
-void vm_area_unmap(int32_t mapid)
+// read swap block id into page, together with the swap blocks that
+// directly follow it if they hold the pages that directly follow
+// upage, up to max pages in all with a single transfer
+// the neighbours only get frames that are free, never evicted ones
+static void swap_in_around(void *upage, swapid_t id, void *page, size_t max)
 {
     struct thread *cur = thread_current();
-    struct mmap_entry entry = {.id = mapid};
-    struct hash_elem *e = hash_find(&cur->mem_map, &entry.elem);
-    ASSERT(e != NULL);
-
-    struct mmap_entry *map = hash_entry(e, struct mmap_entry, elem);
+    void *pages[SWAP_CLUSTER];
+    bool writable[SWAP_CLUSTER];
+    size_t cnt = 1, i;
 
-    size_t off = 0;
-    for (; off < map->size; off++)
+    pages[0] = page;
+    for (; cnt < SWAP_CLUSTER && cnt < max; cnt++)
     {
-        void *p = map->start_addr + off;
+        void *p = upage + cnt * PGSIZE;
+        if (!is_user_vaddr(p))
+            break;
         uint32_t *pte = pagedir_get_pte(cur->pagedir, p, false);
-        ASSERT(pte != NULL);
-        ASSERT(pte_get_user(*pte));
-        ASSERT(pte_get_writable(*pte) == map->writable);
+        if (pte == NULL || pte_get_present(*pte) ||
+            pte_vm_area_type(*pte) != MEM_SWAP ||
+            pte_vm_area_x(*pte) >> 1 != id + cnt)
+            break;
+        pages[cnt] = palloc_get_page(PAL_USER);
+        if (pages[cnt] == NULL)
+            break;
+        writable[cnt] = pte_vm_area_x(*pte) & 1;
+    }
+
+    fault_add_io(swap_in_cluster(id, pages, cnt));
+
+    // the pages differ from whatever backs them until they are written
+    // out again
+    for (i = 1; i < cnt; i++)
+    {
+        if (!pagedir_set_page(cur->pagedir, upage + i * PGSIZE, pages[i], writable[i]))
+            PANIC("read-around of swapped page failed");
+        pagedir_set_dirty(cur->pagedir, upage + i * PGSIZE, true);
+    }
+}
+
+// read the swapped-out page upage, whose pte is pte, into kpage and
+// map it, with up to max - 1 of the pages after it
+static bool swap_load(void *upage, uint32_t *pte, void *kpage, size_t max)
+{
+    uint32_t *pd = thread_current()->pagedir;
+    uint32_t x = pte_vm_area_x(*pte);
+
+    swap_in_around(upage, x >> 1, kpage, max);
+    if (!pagedir_set_page(pd, upage, kpage, x & 1))
+        return false;
+    pagedir_set_dirty(pd, upage, true);
+    return true;
+}
+
+// bytes of page upage of mapping m that come from the file
+static size_t map_page_length(struct vm_area *m, void *upage)
+{
+    size_t size = m->size - (upage - m->start);
+    return size < PGSIZE ? size : PGSIZE;
+}
+
+// read page upage of mapping m into kpage, zeroing the bytes past the
+// end of the mapping or of the file
+static bool map_read_page(struct vm_area *m, void *upage, void *kpage)
+{
+    ASSERT((upage - m->start) % PGSIZE == 0);
+    off_t offset = m->off + (upage - m->start);
+
+    off_t read = file_read_at(m->file, kpage, map_page_length(m, upage), offset);
+    if (read < 0)
+        return false;
+    memset((uint8_t *)kpage + read, 0, PGSIZE - read);
+    return true;
+}
+
+// the pte of upage if it belongs to mapping m and has not been
+// loaded, null otherwise
+static uint32_t *map_page_absent(struct vm_area *m, void *upage)
+{
+    uint32_t *pte;
+
+    if (upage < m->start || upage >= m->end)
+        return NULL;
+    pte = pagedir_get_pte(thread_current()->pagedir, upage, true);
+    if (pte == NULL || *pte != 0)
+        return NULL;
+    return pte;
+}
+
+// the file of mapping m, if its pages may go to the page cache: the
+// mapping is read-only, so its own handle denies writes to the file
+// as long as it lasts
+static struct inode *map_cache_inode(struct vm_area *m)
+{
+    struct inode *inode;
+
+    if (m->writable)
+        return NULL;
+    inode = file_get_inode(m->file);
+    return inode_writes_denied(inode) ? inode : NULL;
+}
+
+// map page upage of mapping m, whose not-present pte is pte, from the
+// page cache, or else read it into a frame, evicting one for it only
+// if evict is true
+// read is set if the page was read from the file
+static bool map_load_page(struct vm_area *m, void *upage, uint32_t *pte,
+                          bool evict, bool *read)
+{
+    struct inode *inode = map_cache_inode(m);
+    off_t offset = m->off + (upage - m->start);
+    size_t length = map_page_length(m, upage);
+
+    *read = false;
+    if (inode != NULL &&
+        frame_table_share(inode, offset, length, pte, upage, *pte) != NULL)
+        return true;
+
+    void *kpage = evict ? frame_table_alloc() : palloc_get_page(PAL_USER);
+    if (kpage == NULL)
+        return false;
+    if (!map_read_page(m, upage, kpage) ||
+        !pagedir_set_page(thread_current()->pagedir, upage, kpage, m->writable))
+    {
+        palloc_free_page(kpage);
+        return false;
+    }
+    if (inode != NULL)
+        frame_table_cache(kpage, pte, inode, offset, length);
+    fault_add_io(length);
+    *read = true;
+    return true;
+}
+
+// load page upage of mapping m, whose not-present pte is pte, and map
+// the pages around it that are absent into frames that are free
+static bool map_fault(struct vm_area *m, void *upage, uint32_t *pte)
+{
+    void *start, *end, *p;
+    size_t read_cnt = 0, around_cnt = 0;
+    enum intr_level old_level;
+    int64_t ticks = timer_ticks();
+    bool read;
+
+    if (!map_load_page(m, upage, pte, true, &read))
+        return false;
+    read_cnt += read;
+
+    // sequential access reads ahead, anything else maps the aligned
+    // block of pages around the fault; MADV_RANDOM maps nothing more,
+    // MADV_SEQUENTIAL reads ahead as far as it goes at once and clears
+    // the accessed bits of the pages behind, which the clock then
+    // takes first
+    if (m->advice == MADV_RANDOM)
+    {
+        m->window = 1;
+        start = upage;
+    }
+    else if (m->advice == MADV_SEQUENTIAL)
+    {
+        for (p = upage - FAULT_AROUND_MAX * PGSIZE; p < upage; p += PGSIZE)
+            if (p >= m->start)
+                pagedir_set_accessed(thread_current()->pagedir, p, false);
+        m->window = FAULT_AROUND_MAX;
+        start = upage;
+    }
+    else if (upage == m->next_fault)
+    {
+        m->window = m->window * 2 < FAULT_AROUND_MAX ? m->window * 2 : FAULT_AROUND_MAX;
+        start = upage;
+    }
+    else
+    {
+        m->window = FAULT_AROUND_MIN;
+        start = m->start +
+                ROUND_DOWN(upage - m->start, FAULT_AROUND_MIN * PGSIZE);
+    }
+    end = start + m->window * PGSIZE;
 
-        if (pte_get_present(*pte))
+    for (p = start; p < end; p += PGSIZE)
+    {
+        uint32_t *around = p != upage ? map_page_absent(m, p) : NULL;
+        if (around == NULL)
+            continue;
+        if (!map_load_page(m, p, around, false, &read))
+            break;
+        read_cnt += read;
+        around_cnt++;
+    }
+    m->next_fault = p > upage ? p : upage + PGSIZE;
+
+    old_level = intr_disable();
+    map_stats.fault_cnt++;
+    map_stats.page_cnt += read_cnt;
+    map_stats.around_cnt += around_cnt;
+    map_stats.read_ticks += timer_elapsed(ticks);
+    intr_set_level(old_level);
+    return true;
+}
+
+// true if the page of pte, which belongs to a file mapping, may differ
+// from the file: it is dirty, or it has been swapped out, which only
+// happens to dirty pages of a mapping
+static bool map_page_dirty(uint32_t *pte)
+{
+    frame_table_wait(pte);
+    if (pte_get_present(*pte))
+        return pte_get_dirty(*pte);
+    return pte_vm_area_type(*pte) == MEM_SWAP;
+}
+
+// write the cnt pages of mapping m from run on, copied into buf, back
+// to the file
+static void map_write_run(struct vm_area *m, void *run, const void *buf,
+                          size_t cnt)
+{
+    enum intr_level old_level;
+    size_t bytes;
+
+    if (cnt == 0)
+        return;
+    bytes = (cnt - 1) * PGSIZE + map_page_length(m, run + (cnt - 1) * PGSIZE);
+    file_write_at(m->file, buf, bytes, m->off + (run - m->start));
+
+    old_level = intr_disable();
+    map_stats.write_cnt++;
+    map_stats.write_page_cnt += cnt;
+    intr_set_level(old_level);
+}
+
+// write the dirty pages of mapping m of the current thread from start
+// to end back to the file
+static void map_writeback(struct vm_area *m, void *start, void *end)
+{
+    struct thread *cur = thread_current();
+    size_t buf_pages = WRITEBACK_PAGES, cnt = 0;
+    uint8_t *buf;
+    void *p, *run = NULL;
+
+    while ((buf = vmalloc(buf_pages * PGSIZE)) == NULL && buf_pages > 1)
+        buf_pages /= 2;
+
+    for (p = start; p < end && p < m->start + m->size; p += PGSIZE)
+    {
+        uint32_t *pte = pagedir_get_pte(cur->pagedir, p, false);
+        if (pte == NULL || !map_page_dirty(pte))
         {
-            // free this page
-            pagedir_clear_page(cur->pagedir, p);
+            map_write_run(m, run, buf, cnt);
+            cnt = 0;
+            continue;
         }
-        else
+        if (buf == NULL)
         {
+            // no bounce buffer: write the page straight from user memory
+            map_write_run(m, p, p, 1);
+            continue;
         }
+        if (cnt == buf_pages)
+        {
+            map_write_run(m, run, buf, cnt);
+            cnt = 0;
+        }
+        if (cnt == 0)
+            run = p;
+        // faults the page back in if it has been swapped out
+        memcpy(buf + cnt++ * PGSIZE, p, map_page_length(m, p));
     }
+    map_write_run(m, run, buf, cnt);
+    vfree(buf);
 }
 
-// the size must be a multiple of PGSIZE
-// return -1 on failure
-void vm_area_zero(void *upage, size_t size, bool writable)
+// try to load
+bool vm_area_load(void *upage, bool write)
 {
-    if ((uint32_t)upage % PGSIZE != 0)
+    struct thread *cur = thread_current();
+    struct vm_area *a;
+    uint32_t *pte;
+    void *p;
+
+    upage = pg_round_down(upage);
+    pte = pagedir_get_pte(cur->pagedir, upage, false);
+    if (pte != NULL && *pte != 0)
+    {
+        // the page may be on its way out to swap
+        frame_table_wait(pte);
+        if (pte_get_present(*pte) || pte_vm_area_type(*pte) != MEM_SWAP)
+            return false;
+
+        // MADV_RANDOM reads no neighbours
+        fault_classify(FAULT_SWAP);
+        a = area_find(cur, upage);
+        if ((p = frame_table_alloc()) == NULL)
+            return false;
+        if (!swap_load(upage, pte, p,
+                       a != NULL && a->advice == MADV_RANDOM ? 1 : SWAP_CLUSTER))
+        {
+            palloc_free_page(p);
+            return false;
+        }
+        return true;
+    }
+
+    // never loaded, or dropped clean: the area tells where from
+    if ((a = area_find(cur, upage)) == NULL)
+        return false;
+    if (pte == NULL && (pte = pagedir_get_pte(cur->pagedir, upage, true)) == NULL)
         return false;
 
-    struct thread *cur = thread_current();
+    if (a->file != NULL)
+    {
+        fault_classify(FAULT_FILE);
+        return map_fault(a, upage, pte);
+    }
 
-    size_t offset = 0;
-    for (; offset < size; offset += PGSIZE)
+    fault_classify(FAULT_ZERO);
+    if (!write)
     {
-        uint32_t *pte = pagedir_get_pte(cur->pagedir, upage + offset, true);
-        ASSERT(pte != NULL);
-        if (*pte != 0)
+        // no frame until the first write
+        enum intr_level old_level;
+
+        frame_table_map_zero(pte, a->writable);
+        old_level = intr_disable();
+        zero_page_cnt++;
+        intr_set_level(old_level);
+        return true;
+    }
+
+    if ((p = frame_table_alloc()) == NULL)
+        return false;
+    memset(p, 0, PGSIZE);
+    if (pagedir_set_page(cur->pagedir, upage, p, a->writable))
+        return true;
+
+    palloc_free_page(p);
+    return false;
+}
+
+// read the swapped-out and file pages of area a from start to end into
+// frames that are free, until there are none left
+static void area_willneed(struct vm_area *a, void *start, void *end)
+{
+    uint32_t *pd = thread_current()->pagedir;
+    enum intr_level old_level;
+    size_t cnt = 0;
+    void *p = start;
+    bool read;
+
+    while (p < end)
+    {
+        // only a file page needs a page table it does not have yet
+        uint32_t *pte = pagedir_get_pte(pd, p, a->file != NULL);
+        if (pte == NULL)
+        {
+            if (a->file != NULL)
+                break;
+            p = (void *)ROUND_DOWN((uintptr_t)p, PTSPAN) + PTSPAN;
+            continue;
+        }
+
+        frame_table_wait(pte);
+        if (*pte == 0 && a->file != NULL)
+        {
+            if (!map_load_page(a, p, pte, false, &read))
+                break;
+            cnt++;
+        }
+        else if (!pte_get_present(*pte) && pte_vm_area_type(*pte) == MEM_SWAP)
         {
-            // clear all
-            size_t s = 0;
-            for (; s < offset; s += PGSIZE)
+            void *kpage = palloc_get_page(PAL_USER);
+            if (kpage == NULL)
+                break;
+            if (!swap_load(p, pte, kpage, SWAP_CLUSTER))
             {
-                uint32_t *pte = pagedir_get_pte(cur->pagedir, upage + s, true);
-                ASSERT(pte != NULL);
-                *pte = 0;
+                palloc_free_page(kpage);
+                break;
             }
-            return false;
+            cnt++;
         }
-        pte_set(pte, MEM_ZERO, (int)writable);
+        p += PGSIZE;
     }
-    return true;
+
+    old_level = intr_disable();
+    advise_stats.willneed_cnt += cnt;
+    intr_set_level(old_level);
 }
 
-// try to load
-bool vm_area_load(void *upage)
+// release the pages of area a from start to end, so that they load
+// from the area again
+static void area_dontneed(struct vm_area *a, void *start, void *end)
+{
+    enum intr_level old_level;
+    size_t cnt;
+
+    if (a->shared)
+        map_writeback(a, start, end);
+    cnt = area_release(start, end);
+
+    old_level = intr_disable();
+    advise_stats.dontneed_cnt += cnt;
+    intr_set_level(old_level);
+}
+
+bool vm_area_advise(void *addr, size_t size, int advice)
 {
     struct thread *cur = thread_current();
-    uint32_t *pte = pagedir_get_pte(cur->pagedir, upage, false);
-    if (pte == NULL)
+    void *end, *p = addr;
+    size_t i;
+
+    if (pg_ofs(addr) != 0 || !is_user_vaddr(addr) ||
+        size > (size_t)((uint8_t *)PHYS_BASE - (uint8_t *)addr) ||
+        advice < MADV_NORMAL || advice > MADV_DONTNEED)
         return false;
+    end = addr + ROUND_UP(size, PGSIZE);
 
-    enum mem_area_type type = pte_vm_area_type(*pte);
-    uint32_t x = pte_vm_area_x(*pte);
+    for (i = area_index(cur, addr); i < cur->area_cnt && cur->areas[i]->start < end; i++)
+    {
+        struct vm_area *a = cur->areas[i];
+        void *s = a->start > addr ? a->start : addr;
+        void *e = a->end < end ? a->end : end;
+
+        if (a->start > p)
+            break;
+        switch (advice)
+        {
+        case MADV_WILLNEED:
+            area_willneed(a, s, e);
+            break;
+        case MADV_DONTNEED:
+            area_dontneed(a, s, e);
+            break;
+        default:
+            a->advice = advice;
+            a->window = 0;
+            a->next_fault = NULL;
+            break;
+        }
+        p = a->end;
+    }
+    return p >= end;
+}
+
+void vm_area_set_stack_limit(size_t kb)
+{
+    if (kb == SIZE_MAX)
+        stack_limit = STACK_LIMIT_DEFAULT;
+    else if (kb > STACK_LIMIT_MAX / 1024)
+        stack_limit = STACK_LIMIT_MAX;
+    else
+        stack_limit = ROUND_UP(kb * 1024, PGSIZE);
+}
+
+bool vm_area_grow_stack(void *addr, void *esp)
+{
+    struct thread *cur = thread_current();
+    void *upage = pg_round_down(addr);
+    void *bottom = cur->stack_bottom;
+    void *limit = PHYS_BASE - stack_limit;
+    void *start = upage, *p;
+    struct vm_area *stack;
+    enum intr_level old_level;
+    size_t ahead = 0, i;
 
-    if (type == 0)
+    if (bottom == NULL || upage >= bottom || upage < limit ||
+        (uint8_t *)addr < (uint8_t *)esp - STACK_SLACK)
         return false;
 
-    void *p = palloc_get_page(PAL_USER | PAL_ZERO);
-    bool writable = false;
-    if (type == MEM_SWAP)
+    if (upage == bottom - PGSIZE)
     {
-        // TODO:
+        start = upage - (STACK_GROW_BATCH - 1) * PGSIZE;
+        if (start < limit)
+            start = limit;
     }
-    else if (type == MEM_ZERO)
+
+    // stretch the stack area down, short of the area below it
+    i = area_index(cur, bottom);
+    ASSERT(i < cur->area_cnt && cur->areas[i]->start == bottom);
+    stack = cur->areas[i];
+    if (i > 0 && cur->areas[i - 1]->end > start)
+        start = cur->areas[i - 1]->end;
+    if (upage < start)
+        return false;
+    stack->start = start;
+    cur->stack_bottom = start;
+
+    if (!vm_area_load(upage, true))
+        return false;
+    for (p = upage - PGSIZE; p >= start; p -= PGSIZE)
     {
-        writable = (bool)x;
+        void *kpage = palloc_get_page(PAL_USER | PAL_ZERO);
+        if (kpage == NULL)
+            break;
+        if (!pagedir_set_page(cur->pagedir, p, kpage, true))
+        {
+            palloc_free_page(kpage);
+            break;
+        }
+        ahead++;
     }
-    else if (type == MEM_MAP)
+
+    old_level = intr_disable();
+    stack_stats.fault_cnt++;
+    stack_stats.page_cnt += (bottom - start) / PGSIZE;
+    stack_stats.ahead_cnt += ahead;
+    intr_set_level(old_level);
+    fault_classify(FAULT_STACK);
+    return true;
+}
+
+void vm_area_set_heap(void *start)
+{
+    struct thread *cur = thread_current();
+    cur->heap_start = cur->brk = pg_round_up(start);
+}
+
+void *vm_area_sbrk(intptr_t increment)
+{
+    struct thread *cur = thread_current();
+    uintptr_t old = (uintptr_t)cur->brk, new = old + increment;
+    void *old_end, *new_end;
+    struct vm_area *heap = NULL;
+    size_t i;
+
+    if (cur->heap_start == NULL ||
+        (increment > 0 && new < old) || (increment < 0 && new > old) ||
+        new < (uintptr_t)cur->heap_start ||
+        new > (uintptr_t)PHYS_BASE - stack_limit)
+        return SBRK_FAILED;
+
+    old_end = pg_round_up((void *)old);
+    new_end = pg_round_up((void *)new);
+    if (old_end > cur->heap_start)
+        heap = area_find(cur, cur->heap_start);
+
+    if (new_end > old_end)
     {
-        struct mmap_entry entry = {.id = (int32_t)x};
-        struct hash_elem *e = hash_find(&cur->mem_map, &entry.elem);
-        ASSERT(e != NULL);
-        struct mmap_entry *m = hash_entry(e, struct mmap_entry, elem);
-        writable = m->writable;
+        if (heap == NULL)
+        {
+            if (!vm_area_zero(cur->heap_start, new_end - cur->heap_start, true))
+                return SBRK_FAILED;
+        }
+        else
+        {
+            // short of the next area
+            i = area_index(cur, heap->start);
+            if (i + 1 < cur->area_cnt && cur->areas[i + 1]->start < new_end)
+                return SBRK_FAILED;
+            heap->end = new_end;
+        }
+    }
+    else if (new_end < old_end)
+    {
+        area_release(new_end, old_end);
+        if (new_end == cur->heap_start)
+        {
+            area_remove(heap);
+            area_free(heap);
+        }
+        else
+            heap->end = new_end;
+    }
 
-        ASSERT((upage - m->start_addr) % PGSIZE == 0);
-        off_t offset = m->off + (upage - m->start_addr);
-        size_t size = m->size - (upage - m->start_addr);
-        if (size > PGSIZE)
-            size = PGSIZE;
+    cur->brk = (void *)new;
+    return (void *)old;
+}
 
-        struct file *f = process_fd_get(m->fd);
-        ASSERT(f != NULL);
+// PINNING
+// load upage for a write if write is true, for a read otherwise, and
+// pin its frame
+static bool pin_page(void *upage, bool write)
+{
+    struct thread *cur = thread_current();
 
-        file_seek(f, offset);
-        if (file_read(f, p, size) < 0)
-            goto fail;
+    for (;;)
+    {
+        uint32_t *pte = pagedir_get_pte(cur->pagedir, upage, false);
+        if (pte != NULL && pte_get_present(*pte))
+        {
+            if (write && !pte_get_writable(*pte))
+            {
+                // copy-on-write, or read-only for good
+                if ((*pte & PTE_COW) == 0 || !vm_area_cow(upage))
+                    return false;
+                continue;
+            }
+            // fails if the frame has been evicted meanwhile
+            if (frame_table_pin(pte))
+                return true;
+            continue;
+        }
+        if (!vm_area_load(upage, write) &&
+            !vm_area_grow_stack(upage, cur->user_esp))
+            return false;
     }
+}
+
+bool vm_area_pin(const void *uaddr, size_t size, bool write)
+{
+    void *start = pg_round_down(uaddr), *p;
+    const uint8_t *end = (const uint8_t *)uaddr + size;
 
-    if (pagedir_set_page(cur->pagedir, upage, p, writable))
+    if (size == 0)
         return true;
-    // TODO: need to refresh TLB?
+    if (end < (const uint8_t *)uaddr || !is_user_vaddr(end - 1))
+        return false;
 
-fail:
-    palloc_free_page(p);
-    return false;
-}
\ No newline at end of file
+    for (p = start; (uint8_t *)p < end; p += PGSIZE)
+        if (!pin_page(p, write))
+        {
+            vm_area_unpin(start, p - start);
+            return false;
+        }
+    return true;
+}
+
+void vm_area_unpin(const void *uaddr, size_t size)
+{
+    uint32_t *pd = thread_current()->pagedir;
+    void *p = pg_round_down(uaddr);
+    const uint8_t *end = (const uint8_t *)uaddr + size;
+
+    for (; (uint8_t *)p < end; p += PGSIZE)
+        frame_table_unpin(pagedir_get_pte(pd, p, false));
+}
+
+// copy-on-write fault
+bool vm_area_cow(void *upage)
+{
+    uint32_t *pte = pagedir_get_pte(thread_current()->pagedir, upage, false);
+    if (pte == NULL)
+        return false;
+    return frame_table_cow(pte, upage);
+}
+
+bool vm_area_fork_pte(uint32_t *child, uint32_t *parent)
+{
+    while (true)
+    {
+        // wait for an eviction in progress to settle
+        frame_table_wait(parent);
+
+        uint32_t v = *parent;
+        if (pte_get_present(v))
+        {
+            // retry if the frame has been evicted meanwhile
+            enum frame_fork result = frame_table_fork(pte_get_page(v), parent, child);
+            if (result != FRAME_FORK_EVICTED)
+                return result == FRAME_FORK_SHARED;
+        }
+        else if (pte_vm_area_type(v) != MEM_EVICTING)
+        {
+            // the parent is blocked, so a not-present pte stays as it is
+            if (pte_vm_area_type(v) == MEM_SWAP)
+                swap_dup(pte_vm_area_x(v) >> 1);
+            *child = v;
+            return true;
+        }
+    }
+}
+
+bool vm_area_fork(struct thread *parent)
+{
+    struct thread *cur = thread_current();
+    size_t i;
+
+    cur->next_mmap_id = parent->next_mmap_id;
+    for (i = 0; i < parent->area_cnt; i++)
+    {
+        struct vm_area *a = parent->areas[i];
+        struct vm_area *copy = malloc(sizeof(struct vm_area));
+        if (copy == NULL)
+            return false;
+        *copy = *a;
+        // the child writes to its copy-on-write pages in private, so
+        // none of them may reach the file
+        copy->shared = false;
+        // a handle of its own, denying writes if the parent's does
+        if (a->file != NULL && (copy->file = file_dup(a->file)) == NULL)
+        {
+            free(copy);
+            return false;
+        }
+        // in order, so each one goes to the end of the array
+        if (!area_insert(copy))
+        {
+            area_free(copy);
+            return false;
+        }
+        if (copy->file != NULL)
+        {
+            ASSERT(hash_insert(&cur->mem_map, &copy->elem) == NULL);
+        }
+    }
+
+    return pagedir_copy(cur->pagedir, parent->pagedir);
+}
+
+unsigned long long vm_area_zero_page_cnt(void)
+{
+    return zero_page_cnt;
+}
+
+void vm_area_print_stats(void)
+{
+    printf("Mmap: %llu faults mapped %llu pages around the fault, "
+           "%llu pages read in %lld ticks\n",
+           map_stats.fault_cnt, map_stats.around_cnt, map_stats.page_cnt,
+           map_stats.read_ticks);
+    printf("Mmap: %llu dirty pages written back in %llu writes\n",
+           map_stats.write_page_cnt, map_stats.write_cnt);
+    printf("Madvise: %llu pages read in ahead, %llu pages released\n",
+           advise_stats.willneed_cnt, advise_stats.dontneed_cnt);
+    printf("Stack: %llu faults grew stacks by %llu pages, "
+           "%llu pages mapped below the fault (limit %zu KB)\n",
+           stack_stats.fault_cnt, stack_stats.page_cnt, stack_stats.ahead_cnt,
+           stack_limit / 1024);
+}
+
+// release whatever the pte refers to: frame or swap block
+void vm_area_destroy_pte(uint32_t *pte)
+{
+    while (true)
+    {
+        // wait for an eviction in progress to settle
+        frame_table_wait(pte);
+
+        uint32_t v = *pte;
+        if (pte_get_present(v))
+        {
+            // fails if the frame has been evicted meanwhile
+            if (frame_table_remove(pte_get_page(v), pte))
+                break;
+        }
+        else
+        {
+            if (pte_vm_area_type(v) == MEM_SWAP)
+                swap_free(pte_vm_area_x(v) >> 1);
+            break;
+        }
+    }
+    *pte = 0;
+}
@@ -4,29 +4,157 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <debug.h>
 
 #include "filesys/off_t.h"
 #include "threads/thread.h"
 #include "vm/swap.h"
 
+/* *
+ * not-present PTE
+ * --------------------------------------------
+ * |                           |   type   | 0 |
+ * --------------------------------------------
+ *           28 bits            3 bits    1 bit
+ *
+ * 0:            not loaded, the area of the page tells where from
+ * MEM_SWAP:     x = swap id << 1 | writable
+ * MEM_EVICTING: the frame is being written out, wait for it
+ * */
+#define PTE_VM_AREA_BITMAP (0xfffffff0)
+
+// present PTE, in one of the bits available to the OS (PTE_AVL):
+// the page is read-only only until the next write, which gives the
+// process a private copy of the frame it shares after a fork
+#define PTE_COW (0x200)
+
+#define PTE_VM_AREA_SIZE_CHECK(_x)       \
+    do                                   \
+    {                                    \
+        uint32_t __x = (uint32_t)(_x);   \
+        ASSERT((__x & 0xf0000000) == 0); \
+    } while (0)
+
+enum mem_area_type
+{
+    MEM_SWAP = 0x2,
+    MEM_EVICTING = 0x4,
+};
+
+#define pte_vm_area_type(pte) ((enum mem_area_type)(((pte)&0xf) >> 1))
+#define pte_vm_area_x(pte) ((uint32_t)(((pte)&PTE_VM_AREA_BITMAP) >> 4))
+
+static inline void pte_set(uint32_t *pte, enum mem_area_type type, uint32_t x)
+{
+    uint32_t t = 0;
+    PTE_VM_AREA_SIZE_CHECK(x);
+    t |= (x << 4);
+
+    uint32_t tp = type & 0x07; // 3 bits
+    t |= (tp << 1);
+
+    *pte = t;
+}
+
 // init
 void vm_area_init(struct thread *t);
 
 // free
 void vm_area_free(struct thread *t);
 
+// map size bytes of the file of fd at off to upage, as one area
 // If the size not a multiple of PGSIZE, then some bytes in the final mapped
 // page "stick out" beyond the end of the file. Set these bytes to zero.
+// the mapping reads its own handle of the file of fd, so it outlives
+// a close of fd
+// shared writes dirty pages back to the file when the mapping goes,
+// by vm_area_unmap or at exit; otherwise writes stay private
 // return -1 on failure
-int32_t vm_area_map(void *upage, int fd, off_t off, size_t size, bool writable);
+int32_t vm_area_map(void *upage, int fd, off_t off, size_t size, bool writable,
+                    bool shared);
 
-void vm_area_unmap(int32_t mapid);
+// write the dirty pages of a shared mapping back and remove it, with
+// the frames and swap blocks of its pages
+// return false if there is no mapping mapid
+bool vm_area_unmap(int32_t mapid);
 
-// the size must be a multiple of PGSIZE
-// return -1 on failure
-void vm_area_zero(void *upage, size_t size, bool writable);
+// reserve an area of zero-filled pages from upage, which is page
+// aligned, to upage + size
+// no page table is touched until the pages are loaded
+// return false if the area overlaps another one or out of memory
+bool vm_area_zero(void *upage, size_t size, bool writable);
+
+// the page of the pte has been written to swap block id
+void vm_area_swap(uint32_t *pte, swapid_t id, bool writable);
+
+// load the page of upage, for a write access if write is true
+// a fault in a file mapping also maps the absent pages around it
+// a read of an untouched zero-filled page maps the shared zero page
+bool vm_area_load(void *upage, bool write);
+
+// stacks grow down from PHYS_BASE to at most kb kB
+// SIZE_MAX picks the default
+void vm_area_set_stack_limit(size_t kb);
+
+// grow the stack of the current process down to addr, a user
+// address that faulted with the stack pointer at esp
+// return false if addr is not a stack access within the limit
+bool vm_area_grow_stack(void *addr, void *esp);
+
+// the heap of the current process starts out empty at start, which is
+// rounded up to a page boundary
+void vm_area_set_heap(void *start);
+
+// move the end of the heap of the current process by increment bytes
+// pages come and go with the heap area, zero-filled on first touch
+// return the old end, (void *) -1 if the heap cannot move there
+void *vm_area_sbrk(intptr_t increment);
+
+// advise how the pages from addr, which is page aligned, to
+// addr + size will be used, with one of the MADV_* values of
+// <syscall-nr.h>
+// MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL set the read-ahead of
+// every area the range touches, as a whole
+// MADV_WILLNEED reads swapped-out and file pages into frames that are
+// free, MADV_DONTNEED releases the frames and swap blocks, writing
+// shared file pages back first; the pages load from their areas again
+// on the next access
+// return false if the advice is unknown or part of the range is not
+// in an area
+bool vm_area_advise(void *addr, size_t size, int advice);
+
+// read faults served by the shared zero page
+unsigned long long vm_area_zero_page_cnt(void);
+
+// bring in the pages of the user buffer of size bytes at uaddr, ready
+// for writes by the kernel if write is true, and pin their frames, so
+// that they stay in memory until vm_area_unpin
+// return false, with nothing pinned, if part of the buffer is not
+// valid user memory, or not writable if write is true
+bool vm_area_pin(const void *uaddr, size_t size, bool write);
+
+// unpin the pages of a buffer pinned by vm_area_pin
+void vm_area_unpin(const void *uaddr, size_t size);
+
+// give the page of upage a private copy of the frame it shares
+// copy-on-write and make it writable
+// return false if upage is not a copy-on-write page
+bool vm_area_cow(void *upage);
+
+// make the not-present child pte refer to what the parent pte of
+// another process does: frames are shared copy-on-write, swap
+// blocks by reference
+// return false if out of memory
+bool vm_area_fork_pte(uint32_t *child, uint32_t *parent);
+
+// copy the file mappings of parent into the current thread, whose
+// address space is still empty, and share its address space
+// return false if out of memory
+bool vm_area_fork(struct thread *parent);
 
-void vm_area_swap(uint32_t *pte, swapid_t id);
+// print statistics of faults in file mappings
+void vm_area_print_stats(void);
 
-bool vm_area_load(void *upage);
-#endif // vm/area.h
\ No newline at end of file
+// release whatever the pte refers to: frame or swap block
+void vm_area_destroy_pte(uint32_t *pte);
+#endif // vm/area.h
@@ -0,0 +1,459 @@
+#include "vm/zswap.h"
+
+#include <bitmap.h>
+#include <debug.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+// cached pages get ids from here on, far above any swap device
+#define ZSWAP_ID_BASE ((swapid_t)1 << 26)
+
+// unit of arena allocation
+#define CHUNK_SIZE 64
+#define CHUNKS(bytes) (((bytes) + CHUNK_SIZE - 1) / CHUNK_SIZE)
+
+// pages that do not compress below this size go to the device
+#define MAX_STORED_SIZE (PGSIZE * 3 / 4)
+
+#define WORD_CNT (PGSIZE / sizeof(uint32_t))
+
+// default arena size: a 16th of memory, at most this many pages
+#define DEFAULT_ARENA_PAGES 256
+
+// a cached page
+struct zswap_entry
+{
+    uint32_t value; // the fill word if size is 0, first chunk otherwise
+    uint16_t size;  // compressed size in bytes, 0 for same-filled pages
+    bool delta;     // the words were delta coded before compression
+    uint16_t refs;  // PTEs that refer to the page, forked processes share it
+};
+
+static struct lock lock;
+
+static uint8_t *arena;
+static struct bitmap *chunk_bits;
+static size_t chunk_cnt;
+static size_t chunk_cursor; // next-fit, like the swap slots
+
+static struct zswap_entry *entries;
+static struct bitmap *entry_bits;
+static size_t entry_cnt;
+
+// compression scratch space
+static uint8_t scratch[PGSIZE];
+static uint32_t deltas[WORD_CNT];
+
+// statistics
+static struct
+{
+    unsigned long long store_cnt;  // pages offered
+    unsigned long long same_cnt;   // stored as a fill word
+    unsigned long long lz_cnt;     // stored compressed
+    unsigned long long delta_cnt;  // of which delta coded
+    unsigned long long reject_cnt; // did not compress well
+    unsigned long long full_cnt;   // compressed, but no room
+    unsigned long long load_cnt;
+    unsigned long long stored_bytes; // compressed bytes of lz pages
+    size_t used_chunks;
+    size_t peak_chunks;
+} stats;
+
+void zswap_init(size_t arena_pages)
+{
+    lock_init(&lock);
+
+    if (arena_pages == SIZE_MAX)
+    {
+        arena_pages = palloc_page_cnt() / 16;
+        if (arena_pages > DEFAULT_ARENA_PAGES)
+            arena_pages = DEFAULT_ARENA_PAGES;
+    }
+    // settle for a smaller arena if kernel memory is tight
+    for (; arena_pages > 0; arena_pages /= 2)
+    {
+        arena = palloc_get_multiple(0, arena_pages);
+        if (arena != NULL)
+            break;
+    }
+    if (arena == NULL)
+        return;
+
+    chunk_cnt = arena_pages * PGSIZE / CHUNK_SIZE;
+    chunk_bits = bitmap_create(chunk_cnt);
+    // every lz page takes at least a chunk, same-filled pages none,
+    // so this many entries fill the arena well
+    entry_cnt = chunk_cnt;
+    entry_bits = bitmap_create(entry_cnt);
+    entries = calloc(entry_cnt, sizeof *entries);
+    if (chunk_bits == NULL || entry_bits == NULL || entries == NULL)
+        PANIC("zswap: out of memory for %zu arena pages", arena_pages);
+}
+
+// LZ COMPRESSION
+// an LZ77 variant in the spirit of LZ4.  The output is a series of
+// sequences: a token byte holding the literal count in its high
+// nibble and the match length minus MIN_MATCH in its low nibble, a
+// nibble of 15 being continued in further bytes of up to 255 each;
+// the literals; a 2-byte little-endian match offset.  The last
+// sequence has literals only.
+#define MIN_MATCH 4
+#define HASH_BITS 10
+
+static uint16_t hash_table[1 << HASH_BITS];
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static size_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// append length len beyond a nibble of 15 to out
+// return the new out, null if it would pass end
+static uint8_t *put_length(uint8_t *out, uint8_t *end, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (out >= end)
+            return NULL;
+        *out++ = 255;
+    }
+    if (out >= end)
+        return NULL;
+    *out++ = len;
+    return out;
+}
+
+// emit a sequence of lit_len literals from lit and a match of
+// match_len bytes at offset back, or no match if match_len is 0
+// return the new out, null if it would pass end
+static uint8_t *put_sequence(uint8_t *out, uint8_t *end,
+                             const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len)
+{
+    size_t m = match_len > 0 ? match_len - MIN_MATCH : 0;
+    uint8_t *token = out++;
+
+    if (token >= end)
+        return NULL;
+    *token = ((lit_len < 15 ? lit_len : 15) << 4) | (m < 15 ? m : 15);
+    if (lit_len >= 15 && (out = put_length(out, end, lit_len - 15)) == NULL)
+        return NULL;
+    if (out + lit_len > end)
+        return NULL;
+    memcpy(out, lit, lit_len);
+    out += lit_len;
+    if (match_len == 0)
+        return out;
+
+    if (out + 2 > end)
+        return NULL;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (m >= 15 && (out = put_length(out, end, m - 15)) == NULL)
+        return NULL;
+    return out;
+}
+
+// compress the page at in into out, which has room for cap bytes
+// return the compressed size, 0 if it does not fit
+static size_t lz_compress(const uint8_t *in, uint8_t *out, size_t cap)
+{
+    uint8_t *o = out, *end = out + cap;
+    size_t ip = 1, anchor = 0;
+
+    memset(hash_table, 0, sizeof hash_table);
+    while (ip + MIN_MATCH <= PGSIZE)
+    {
+        uint32_t seq = read32(in + ip);
+        size_t h = hash32(seq);
+        size_t ref = hash_table[h];
+        hash_table[h] = ip;
+
+        // position 0 doubles as the empty slot, so it never matches
+        if (ref == 0 || read32(in + ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+
+        size_t len = MIN_MATCH;
+        while (ip + len < PGSIZE && in[ref + len] == in[ip + len])
+            len++;
+        o = put_sequence(o, end, in + anchor, ip - anchor, ip - ref, len);
+        if (o == NULL)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    o = put_sequence(o, end, in + anchor, PGSIZE - anchor, 0, 0);
+    return o != NULL ? (size_t)(o - out) : 0;
+}
+
+// read a length continued beyond a nibble of 15
+static const uint8_t *get_length(const uint8_t *in, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        b = *in++;
+        *len += b;
+    } while (b == 255);
+    return in;
+}
+
+// decompress size bytes at in into the page at out
+static void lz_decompress(const uint8_t *in, size_t size, uint8_t *out)
+{
+    const uint8_t *end = in + size;
+    uint8_t *o = out;
+
+    while (in < end)
+    {
+        uint8_t token = *in++;
+        size_t lit_len = token >> 4, match_len = token & 0xf;
+
+        if (lit_len == 15)
+            in = get_length(in, &lit_len);
+        memcpy(o, in, lit_len);
+        in += lit_len;
+        o += lit_len;
+        if (in >= end)
+            break;
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (match_len == 15)
+            in = get_length(in, &match_len);
+        match_len += MIN_MATCH;
+
+        // the match may overlap what it produces
+        const uint8_t *ref = o - offset;
+        while (match_len-- > 0)
+            *o++ = *ref++;
+    }
+    ASSERT(o == out + PGSIZE);
+}
+
+// true if all words of page equal the first one
+static bool same_filled(const void *page)
+{
+    const uint32_t *w = page;
+    size_t i;
+
+    for (i = 1; i < WORD_CNT; i++)
+        if (w[i] != w[0])
+            return false;
+    return true;
+}
+
+// DELTA CODING
+// arrays of sorted or evenly spaced integers look random to LZ, but
+// the differences between neighbouring words repeat
+
+static void delta_encode(const uint32_t *w, uint32_t *d)
+{
+    size_t i;
+
+    d[0] = w[0];
+    for (i = 1; i < WORD_CNT; i++)
+        d[i] = w[i] - w[i - 1];
+}
+
+// undo delta_encode in place
+static void delta_decode(uint32_t *w)
+{
+    size_t i;
+
+    for (i = 1; i < WORD_CNT; i++)
+        w[i] += w[i - 1];
+}
+
+// compress page into scratch, delta coded if that is what it takes
+// return the compressed size, 0 if it does not compress well
+static size_t compress(const void *page, bool *delta)
+{
+    size_t size = lz_compress(page, scratch, MAX_STORED_SIZE);
+
+    *delta = false;
+    if (size == 0)
+    {
+        delta_encode(page, deltas);
+        size = lz_compress((const uint8_t *)deltas, scratch, MAX_STORED_SIZE);
+        *delta = true;
+    }
+    return size;
+}
+
+// allocate cnt consecutive arena chunks
+// must be called with lock held
+static size_t chunk_alloc(size_t cnt)
+{
+    size_t c = bitmap_scan_and_flip(chunk_bits, chunk_cursor, cnt, false);
+    if (c == BITMAP_ERROR && chunk_cursor != 0)
+        c = bitmap_scan_and_flip(chunk_bits, 0, cnt, false);
+    if (c == BITMAP_ERROR)
+        return BITMAP_ERROR;
+
+    chunk_cursor = c + cnt < chunk_cnt ? c + cnt : 0;
+    stats.used_chunks += cnt;
+    if (stats.used_chunks > stats.peak_chunks)
+        stats.peak_chunks = stats.used_chunks;
+    return c;
+}
+
+swapid_t zswap_store(const void *page)
+{
+    size_t idx, size = 0;
+    uint32_t value;
+    bool delta = false;
+
+    if (arena == NULL)
+        return SWAP_ERROR;
+
+    lock_acquire(&lock);
+    stats.store_cnt++;
+    if (same_filled(page))
+        value = *(const uint32_t *)page;
+    else
+    {
+        size = compress(page, &delta);
+        if (size == 0)
+        {
+            stats.reject_cnt++;
+            lock_release(&lock);
+            return SWAP_ERROR;
+        }
+    }
+
+    idx = bitmap_scan_and_flip(entry_bits, 0, 1, false);
+    if (idx == BITMAP_ERROR)
+        goto full;
+    if (size > 0)
+    {
+        size_t chunk = chunk_alloc(CHUNKS(size));
+        if (chunk == BITMAP_ERROR)
+        {
+            bitmap_reset(entry_bits, idx);
+            goto full;
+        }
+        memcpy(arena + chunk * CHUNK_SIZE, scratch, size);
+        value = chunk;
+        stats.lz_cnt++;
+        if (delta)
+            stats.delta_cnt++;
+        stats.stored_bytes += size;
+    }
+    else
+        stats.same_cnt++;
+
+    entries[idx].value = value;
+    entries[idx].size = size;
+    entries[idx].delta = delta;
+    entries[idx].refs = 1;
+    lock_release(&lock);
+    return ZSWAP_ID_BASE + idx;
+
+full:
+    stats.full_cnt++;
+    lock_release(&lock);
+    return SWAP_ERROR;
+}
+
+bool zswap_owns(swapid_t id)
+{
+    return id != SWAP_ERROR && id >= ZSWAP_ID_BASE;
+}
+
+// drop a reference to entry idx, release it with the last one
+// must be called with lock held
+static void entry_put(size_t idx)
+{
+    struct zswap_entry *e = &entries[idx];
+
+    ASSERT(bitmap_test(entry_bits, idx) && e->refs > 0);
+    if (--e->refs > 0)
+        return;
+    if (e->size > 0)
+    {
+        bitmap_set_multiple(chunk_bits, e->value, CHUNKS(e->size), false);
+        stats.used_chunks -= CHUNKS(e->size);
+    }
+    bitmap_reset(entry_bits, idx);
+}
+
+void zswap_load(swapid_t id, void *page)
+{
+    size_t idx = id - ZSWAP_ID_BASE;
+    struct zswap_entry *e = &entries[idx];
+
+    ASSERT(zswap_owns(id) && idx < entry_cnt);
+    lock_acquire(&lock);
+    if (e->size > 0)
+    {
+        lz_decompress(arena + e->value * CHUNK_SIZE, e->size, page);
+        if (e->delta)
+            delta_decode(page);
+    }
+    else
+    {
+        uint32_t *w = page;
+        size_t i;
+        for (i = 0; i < WORD_CNT; i++)
+            w[i] = e->value;
+    }
+    entry_put(idx);
+    stats.load_cnt++;
+    lock_release(&lock);
+}
+
+void zswap_dup(swapid_t id)
+{
+    size_t idx = id - ZSWAP_ID_BASE;
+
+    ASSERT(zswap_owns(id) && idx < entry_cnt);
+    lock_acquire(&lock);
+    ASSERT(bitmap_test(entry_bits, idx) && entries[idx].refs < UINT16_MAX);
+    entries[idx].refs++;
+    lock_release(&lock);
+}
+
+void zswap_free(swapid_t id)
+{
+    size_t idx = id - ZSWAP_ID_BASE;
+
+    ASSERT(zswap_owns(id) && idx < entry_cnt);
+    lock_acquire(&lock);
+    entry_put(idx);
+    lock_release(&lock);
+}
+
+void zswap_print_stats(void)
+{
+    unsigned long long lz_bytes = stats.lz_cnt * PGSIZE;
+
+    if (arena == NULL)
+        return;
+    printf("Zswap: %llu pages offered, %llu same-filled, %llu compressed "
+           "(%llu delta coded) to %llu%%, %llu incompressible, "
+           "%llu rejected when full\n",
+           stats.store_cnt, stats.same_cnt, stats.lz_cnt, stats.delta_cnt,
+           lz_bytes > 0 ? stats.stored_bytes * 100 / lz_bytes : 0,
+           stats.reject_cnt, stats.full_cnt);
+    printf("Zswap: %llu pages loaded, %zu of %zu arena KB in use (peak %zu)\n",
+           stats.load_cnt, stats.used_chunks * CHUNK_SIZE / 1024,
+           chunk_cnt * CHUNK_SIZE / 1024,
+           stats.peak_chunks * CHUNK_SIZE / 1024);
+}
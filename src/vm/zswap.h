@@ -0,0 +1,40 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "vm/swap.h"
+
+// compressed swap cache
+// evicted pages that compress well are kept compressed in a bounded
+// arena of kernel pages instead of being written to the swap device.
+// Pages whose words all have the same value take no arena space.
+// Cached pages have swap ids of their own, above those of the
+// device, so that PTEs refer to them like to any swap block.
+
+// the arena gets at most arena_pages kernel pages
+// 0 disables the cache, SIZE_MAX picks a size from the memory size
+void zswap_init(size_t arena_pages);
+
+// compress page into the cache
+// return its id, SWAP_ERROR if the page does not compress well or
+// the cache is full
+swapid_t zswap_store(const void *page);
+
+// true if id refers to a page in the cache
+bool zswap_owns(swapid_t id);
+
+// decompress the page of id and drop a reference to it
+void zswap_load(swapid_t id, void *page);
+
+// add a reference to the page of id, for a PTE that shares it
+void zswap_dup(swapid_t id);
+
+// drop a reference to the page of id without reading it
+// the page is released with the last reference
+void zswap_free(swapid_t id);
+
+// print compression statistics
+void zswap_print_stats(void);
+#endif